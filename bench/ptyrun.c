@@ -0,0 +1,221 @@
+/*
+ * run an editor in a pseudo terminal, type at it and time how long it
+ * takes to show some text, then quit it and report its peak RSS.
+ *
+ *   ptyrun [-k keys] [-w text] [-i ms] ... -- command [args]
+ *
+ * -k sends keys, with \r, \e, \\ and \xNN escapes. -w waits until a row
+ * of the screen shows text and prints the time since the last step. -i
+ * waits until nothing has been drawn for the given milliseconds and
+ * prints the time from the last keys to the last output, for work that
+ * redraws as it goes. once the steps are done the command is sent ^Q
+ * until it exits.
+ *
+ * the screen only follows what pico sends: cursor moves, clearing the
+ * screen or a line and text. colors and modes are dropped.
+ */
+#define _GNU_SOURCE
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROWS 24
+#define COLS 80
+#define TIMEOUT_MS 600000
+
+int master;
+int64_t drawn;            // when output was last read
+
+struct {
+  char cell[ROWS][COLS + 1];
+  int y, x;
+  int escape;             // 1 after ESC, 2 inside a CSI sequence
+  int param[2];
+  int nparam;
+} screen;
+
+int64_t nowMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void die(const char *s) {
+  perror(s);
+  exit(1);
+}
+
+void screenClear(int y, int x) {
+  for (; y < ROWS; y++, x = 0) memset(&screen.cell[y][x], ' ', COLS - x);
+}
+
+void screenCsi(char c) {
+  int *p = screen.param;
+  if (c == 'H') {
+    screen.y = p[0] > 0 ? p[0] - 1 : 0;
+    screen.x = p[1] > 0 ? p[1] - 1 : 0;
+    if (screen.y >= ROWS) screen.y = ROWS - 1;
+    if (screen.x >= COLS) screen.x = COLS - 1;
+  } else if (c == 'J') {
+    screenClear(0, 0);
+  } else if (c == 'K') {
+    memset(&screen.cell[screen.y][screen.x], ' ', COLS - screen.x);
+  }
+}
+
+void take(const char *buf, ssize_t n) {
+  for (ssize_t i = 0; i < n; i++) {
+    unsigned char c = buf[i];
+    if (screen.escape == 1) {
+      screen.escape = c == '[' ? 2 : 0;
+      screen.param[0] = screen.param[1] = 0;
+      screen.nparam = 0;
+    } else if (screen.escape == 2) {
+      if (c >= '0' && c <= '9') {
+        if (screen.nparam < 2)
+          screen.param[screen.nparam] = screen.param[screen.nparam] * 10
+                                        + c - '0';
+      } else if (c == ';') {
+        screen.nparam++;
+      } else if (c >= 0x40 && c <= 0x7e) {
+        screenCsi(c);
+        screen.escape = 0;
+      }
+    } else if (c == 0x1b) {
+      screen.escape = 1;
+    } else if (c == '\r') {
+      screen.x = 0;
+    } else if (c == '\n') {
+      if (screen.y < ROWS - 1) screen.y++;
+    } else if (c >= ' ' && screen.x < COLS) {
+      screen.cell[screen.y][screen.x++] = c;
+    }
+  }
+}
+
+int screenShows(const char *text) {
+  for (int y = 0; y < ROWS; y++)
+    if (strstr(screen.cell[y], text)) return 1;
+  return 0;
+}
+
+// read output for up to ms, returns 0 once the command has gone
+int pump(int ms) {
+  struct pollfd pfd = {master, POLLIN, 0};
+  if (poll(&pfd, 1, ms) <= 0) return 1;
+  char buf[65536];
+  ssize_t n = read(master, buf, sizeof(buf));
+  if (n <= 0) return 0;
+  drawn = nowMillis();
+  take(buf, n);
+  return 1;
+}
+
+void sendKeys(const char *k) {
+  char out[1024];
+  size_t n = 0;
+  for (; *k && n < sizeof(out); k++) {
+    if (*k != '\\' || k[1] == '\0') {
+      out[n++] = *k;
+      continue;
+    }
+    k++;
+    if (*k == 'r') out[n++] = '\r';
+    else if (*k == 'e') out[n++] = 0x1b;
+    else if (*k == 'x' && k[1] && k[2]) {
+      char hex[3] = {k[1], k[2], 0};
+      out[n++] = strtol(hex, NULL, 16);
+      k += 2;
+    } else out[n++] = *k;
+  }
+  if (write(master, out, n) != (ssize_t) n) die("write");
+}
+
+int waitFor(const char *text) {
+  int64_t until = nowMillis() + TIMEOUT_MS;
+  while (nowMillis() < until) {
+    if (screenShows(text)) return 1;
+    if (!pump(100)) return 0;
+  }
+  return 0;
+}
+
+// quiet for ms since the later of the last output and since
+int waitIdle(int ms, int64_t since) {
+  int64_t until = nowMillis() + TIMEOUT_MS;
+  while (nowMillis() < until) {
+    if (nowMillis() - (drawn > since ? drawn : since) >= ms) return 1;
+    if (!pump(ms)) return 0;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int cmd = 1;
+  while (cmd < argc && strcmp(argv[cmd], "--") != 0) cmd++;
+  if (cmd + 1 >= argc) {
+    fprintf(stderr, "usage: %s [-k keys] [-w text] [-i ms] ... -- command"
+            " [args]\n", argv[0]);
+    return 2;
+  }
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  screenClear(0, 0);
+
+  struct winsize ws = {ROWS, COLS, 0, 0};
+  int64_t start = nowMillis();
+  pid_t pid = forkpty(&master, NULL, NULL, &ws);
+  if (pid == -1) die("forkpty");
+  if (pid == 0) {
+    setenv("TERM", "xterm", 1);
+    execvp(argv[cmd + 1], &argv[cmd + 1]);
+    die("exec");
+  }
+
+  int ok = 1;
+  int64_t last = start;
+  char *keys = "start";
+  for (int i = 1; i + 1 < cmd && ok; i += 2) {
+    if (strcmp(argv[i], "-k") == 0) {
+      sendKeys(argv[i + 1]);
+      keys = argv[i + 1];
+      last = nowMillis();
+    } else if (strcmp(argv[i], "-w") == 0) {
+      ok = waitFor(argv[i + 1]);
+      int64_t now = nowMillis();
+      if (ok) printf("%-24s %8lld ms\n", argv[i + 1], (long long) (now - last));
+      else printf("%-24s timed out\n", argv[i + 1]);
+      last = now;
+    } else if (strcmp(argv[i], "-i") == 0) {
+      ok = waitIdle(atoi(argv[i + 1]), last);
+      int64_t took = drawn > last ? drawn - last : 0;
+      if (ok) printf("%-24s %8lld ms\n", keys, (long long) took);
+      else printf("%-24s timed out\n", keys);
+      last = nowMillis();
+    }
+  }
+
+  // quit, confirming through any unsaved changes warning
+  int64_t until = nowMillis() + 10000;
+  int alive = 1;
+  while (alive && nowMillis() < until) {
+    if (write(master, "\x11", 1) != 1) break;
+    for (int j = 0; j < 5 && (alive = pump(20)); j++);
+  }
+  if (alive) kill(pid, SIGKILL);
+  while (pump(20));
+
+  int status;
+  waitpid(pid, &status, 0);
+  struct rusage ru;
+  getrusage(RUSAGE_CHILDREN, &ru);
+  printf("%-24s %8ld MB\n", "peak rss", ru.ru_maxrss / 1024);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,112 @@
+/*
+ * row insertion against the old array that grew by one row per insert,
+ * built with the editor itself: make bench
+ */
+#define main pico_main
+#include "../pico.c"
+#undef main
+
+#define OLD_LIMIT 64000     // the old middle inserts are quadratic past this
+
+// the old row array: realloc by one and shift the tail on every insert
+struct {
+  erow *row;
+  int64_t numrows;
+} old;
+
+void oldInsertRow(int64_t at, char *s, size_t len) {
+  old.row = realloc(old.row, sizeof(erow) * (old.numrows + 1));
+  if (old.row == NULL) die("realloc");
+  memmove(&old.row[at + 1], &old.row[at],
+          sizeof(erow) * (old.numrows - at));
+  char *chars = malloc(len + 1);
+  memcpy(chars, s, len);
+  chars[len] = '\0';
+  editorInitRow(&old.row[at], chars, len, 0);
+  old.numrows++;
+}
+
+void oldReset() {
+  for (int64_t i = 0; i < old.numrows; i++) free(old.row[i].chars);
+  free(old.row);
+  old.row = NULL;
+  old.numrows = 0;
+}
+
+void rowsReset() {
+  rowiter it;
+  for (erow *row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it))
+    editorFreeRow(row);
+  if (config.rows) rowFreeNode(config.rows);
+  config.rows = rowNewNode(1);
+  config.numrows = 0;
+}
+
+double millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+#define LINE "lorem ipsum dolor sit amet"
+
+// one row at a time at the end, or in the middle, of n rows
+double timeOld(int64_t n, bool middle) {
+  double start = millis();
+  for (int64_t i = 0; i < n; i++)
+    oldInsertRow(middle ? i / 2 : i, LINE, sizeof(LINE) - 1);
+  double t = millis() - start;
+  oldReset();
+  return t;
+}
+
+double timeNew(int64_t n, bool middle) {
+  double start = millis();
+  for (int64_t i = 0; i < n; i++)
+    editorInsertRow(middle ? i / 2 : i, LINE, sizeof(LINE) - 1);
+  double t = millis() - start;
+  rowsReset();
+  return t;
+}
+
+// n rows appended ROW_BATCH at a time, the way files are read
+double timeBatch(int64_t n) {
+  double start = millis();
+  erow *batch = malloc(sizeof(erow) * ROW_BATCH);
+  for (int64_t i = 0; i < n; ) {
+    int64_t k = 0;
+    for (; k < ROW_BATCH && i < n; k++, i++) {
+      char *chars = malloc(sizeof(LINE));
+      memcpy(chars, LINE, sizeof(LINE));
+      editorInitRow(&batch[k], chars, sizeof(LINE) - 1, 0);
+    }
+    editorInsertRows(config.numrows, batch, k);
+  }
+  free(batch);
+  double t = millis() - start;
+  rowsReset();
+  return t;
+}
+
+void cell(double ms) {
+  if (ms < 0) printf(" %12s", "-");
+  else printf(" %9.1f ms", ms);
+}
+
+int main() {
+  config.rows = rowNewNode(1);
+  pipe2(config.wakefd, O_NONBLOCK);
+
+  printf("%8s %12s %12s %12s %12s %12s\n", "rows", "append old",
+         "append new", "batch new", "middle old", "middle new");
+  for (int64_t n = 16000; n <= 4096000; n *= 4) {
+    printf("%8" PRId64, n);
+    cell(timeOld(n, 0));
+    cell(timeNew(n, 0));
+    cell(timeBatch(n));
+    cell(n <= OLD_LIMIT ? timeOld(n, 1) : -1);
+    cell(timeNew(n, 1));
+    printf("\n");
+  }
+  return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# time an editor binary on a generated file: sh bench/run.sh [pico] [MB]
+set -e
+
+PICO=${1:-build/pico}
+MB=${2:-1024}
+DIR=$(dirname "$0")
+RUN=${PTYRUN:-build/ptyrun}
+FILE=build/bench.txt
+
+if [ ! -f $FILE ] || [ $(($(wc -c < $FILE) >> 20)) -ne $MB ]; then
+  echo "generating $MB MB in $FILE"
+  seq -f "line %.0f lorem ipsum dolor sit amet, consectetur adipiscing elit" \
+    1 $((MB * 16384)) | head -c $((MB << 20)) > $FILE
+fi
+rm -f build/.bench.txt.swp
+
+echo "== load: first frame, then rows indexed in the background"
+$RUN -w " lines |" -i 1000 -- $PICO $FILE
+
+echo "== search: jump to a line near the middle, then count a word on every line"
+MID="line $((MB * 8192)) lorem"
+$RUN -w " lines |" -i 1000 -k / -k "$MID" -w "$((MB * 8192))|$MID" \
+  -k '\r' -k / -k ipsum -i 2000 -- $PICO $FILE
+
+echo "== save: change the first line so every row is written again"
+cp $FILE build/bench-save.txt
+rm -f build/.bench-save.txt.swp
+$RUN -w " lines |" -i 1000 -k ix -w "xline 1 lorem" -k '\e' -w NORMAL \
+  -k '\x13' -w "bytes written" -- $PICO build/bench-save.txt
+rm -f build/bench-save.txt
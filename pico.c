@@ -16,19 +16,34 @@
 #include <stdlib.h>
 #include <termios.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <inttypes.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*** defines ***/
 
 #define CLEAR_SCREEN_STRING "\x1b[2J"
 #define CLEAR_LINE_STRING "\x1b[K"
 #define RESET_MOUSE_POS_STRING "\x1b[H"
+#define PASTE_ON_STRING "\x1b[?2004h"
+#define PASTE_OFF_STRING "\x1b[?2004l"
+#define PASTE_END_STRING "\x1b[201~"
 
 #define RESET_ESCAPE "\x1b[m"
 #define BOLD_ESCAPE "\x1b[1m"
@@ -36,6 +51,10 @@
 #define ITALIC_ESCAPE "\x1b[3m"
 #define INVERT_ESCAPE "\x1b[7m"
 
+#define STYLE_BOLD   1
+#define STYLE_ITALIC 2
+#define STYLE_INVERT 4
+
 #define PICO_VERSION "1.3.3"
 
 #define CTRL_KEY(k) ((k) & 0x1f)
@@ -44,37 +63,297 @@
 
 #define SCROLL_PADDING 4
 #define TAB_STOP 2
-#define CURSOR_OFFSET 6
+#define LINENO_MIN_WIDTH 5
 
 #define QUIT_TIMES 3
 
+#define INPUT_BUF_SIZE 4096
+#define ESC_TIMEOUT_MS 50   // wait for the rest of an escape sequence
+
+#define STATUS_TIMEOUT 5    // seconds a status message stays up
+
+#define ROW_BATCH 4096
+#define LOAD_STEP (4 << 20) // bytes of a mapped file indexed at a time
+#define WRITE_IOVS 1024    // iovecs per writev, linux's IOV_MAX
+#define SEARCH_CHUNK (1 << 20)  // bytes a search worker claims at a time
+#define SEARCH_BLOCK 65536  // bytes scanned between checks for a cancel
+#define SEARCH_INLINE 65536 // buffers up to this are searched in place
+#define SEARCH_SETTLE 300   // ms edits pause before the index is rebuilt
+#define SEARCH_SETTLE_MAX 3000  // ms the index waits at most after an edit
+#define SEARCH_THREADS 8
+#define SEARCH_REGEX 1
+#define SEARCH_ICASE 2
+#define SEARCH_WORD  4
+#define DFA_MAX_STATES 1024
+#define DFA_TABLE_SIZE 2048
+#ifndef UNDO_LIMIT
+#define UNDO_LIMIT (256 << 20)  // bytes of undo history kept at most
+#endif
+#define UNDO_INSERT 0
+#define UNDO_DELETE 1
+#define SWAP_INTERVAL 2000  // ms edits wait before going to the swap file
+#define SWAP_MAGIC "PICOSWP1"
+#define FOLLOW_READ 65536   // bytes read from a followed file at a time
+#define FOLLOW_BURST 64     // reads before the screen gets a turn
+#define HL_LOOKAHEAD 32     // rows rendered past each edge of the viewport
+#define HL_CACHE_ROWS 65536 // rendered rows kept before far ones are dropped
+#define SYNTAX_BLOCK_COMMENTS 1  // /* */
+#define SYNTAX_TRIPLE_QUOTES 2   // """ and '''
+#define ROWS_PER_LEAF 512
+#define NODE_CHILDREN 32
+
 typedef int8_t bool;
 
 /*** data ***/
 
 typedef struct erow {
-  int16_t size;
-  int16_t rsize;
+  int64_t size;
+  int64_t rsize;
   char *chars;
-  char *render;
+  char *render;     // NULL until the row is first drawn or searched
   char *hl;
+  int64_t tabs;     // tabs in chars, valid while render is
+  bool mapped;      // chars points into config.map, not owned
+  uint8_t hlin;     // syntax state the row starts in, see syntax
+  uint8_t hlout;    // and the one it ends in, valid while hlscan is
+  bool hlscan;
+  bool modified;    // changed since the file was last opened or saved
 } erow;
 
+typedef struct rownode {
+  struct rownode *parent;
+  struct rownode *prev, *next;  // neighbouring leaves
+  int64_t count;                // rows stored below this node
+  int16_t n;                    // used entries of rows or child
+  bool leaf;
+  erow *rows;
+  struct rownode *child[NODE_CHILDREN];
+} rownode;
+
+typedef struct rowiter {
+  rownode *leaf;
+  int16_t idx;
+} rowiter;
+
+typedef struct scell {
+  char c;
+  uint8_t fg;       // sgr colour code, 0 for the terminal default
+  uint8_t bg;
+  uint8_t style;    // STYLE_* flags
+} scell;
+
+struct screen {
+  scell *front;     // what the terminal currently shows
+  scell *back;      // the frame being drawn
+  int16_t rows, cols;
+  int16_t cursor_y, cursor_x;
+  bool valid;       // front is in sync with the terminal
+  size_t frame_bytes;
+};
+
+struct inputbuf {
+  char buf[INPUT_BUF_SIZE];
+  int16_t len;      // bytes read from the terminal
+  int16_t pos;      // bytes already turned into keys
+};
+
+struct searchchunk {
+  int64_t *rows;    // rows holding a match, ascending
+  int32_t *counts;  // matches in each of those rows
+  int64_t nrows, cap;
+  int64_t matches;  // non-overlapping matches in those rows
+  int done;         // set once rows is complete, read atomically
+};
+
+typedef struct nfastate {
+  int16_t op;
+  int16_t out, out1;
+  uint8_t set[32];  // bytes an NFA_SET state consumes
+} nfastate;
+
+typedef struct pattern {
+  nfastate *states;
+  int16_t n;
+  int16_t start;    // anchored at the match start
+  int16_t ustart;   // skips any prefix first
+  bool word;
+  bool reversed;    // matches the query read back to front
+  struct pattern *back;   // the reversed pattern, NULL if this is one
+} pattern;
+
+typedef struct dfastate {
+  int16_t *set;     // sorted nfa states
+  int16_t n;        // 0 for the dead state
+  uint32_t hash;
+  bool accept;      // a match ends before the next byte
+  int8_t accept_eol;  // a match ends at the end of the row, -1 unknown
+  int32_t next[256];  // -1 until first taken
+} dfastate;
+
+typedef struct dfa {
+  pattern *re;
+  dfastate *states;
+  int32_t n;
+  int32_t *table;   // open addressing over states by set
+  int32_t start[2]; // anchored starts, indexed by bol
+  int32_t ustart;
+  int32_t lstart[3];  // leftmost starts: none, not at bol, at bol
+  uint32_t flushes;
+  uint32_t epoch;   // closure marks in seen
+  uint32_t *seen;
+  int16_t *stack;
+  int16_t *set;     // the set under construction
+  int16_t nset;
+  uint64_t gen;     // search job scanned for, 0 if it cannot be cancelled
+  struct dfa *back; // over re->back, finds where a match starts
+} dfa;
+
+struct searchview {
+  int64_t rowoff, coloff;
+  int16_t rows, cols;
+  uint64_t version; // search version the spans were found for
+  int32_t *first;   // per screen row, index of its first span
+  int64_t *spans;   // pairs of render columns
+  int32_t n, cap;
+};
+
+struct search {
+  char *query;      // the query chunks belong to, NULL without a search
+  size_t qlen;
+  int16_t mode;     // SEARCH_* flags toggled in the prompt
+  int16_t qmode;    // the flags chunks belong to
+  pattern *re;      // NULL for plain literal queries
+  dfa dfa;          // the ui thread's, workers keep their own
+  const char *error;
+  struct searchchunk *chunks;
+  struct searchchunk *prev;     // chunks of the query before, or NULL
+  int64_t nchunks;
+  int64_t *bounds;  // first row of each chunk, then numrows
+  int64_t ncut;     // chunks in bounds
+  int64_t bytes;    // in the rows when they were cut
+  bool cut;         // bounds still fit the rows
+  int64_t matches;  // over the chunks finished so far
+  int64_t ndone;    // chunks finished so far
+  bool prompting;   // the search prompt is open
+  bool jump;        // move to the first match once it is known
+  bool stale;       // rows changed since the chunks were scanned
+  bool recount;     // rescanning after edits, the count waits for it
+  int64_t staled;   // when the chunks went stale, in ms
+  int64_t edited;   // when version last moved while stale
+  uint64_t settled; // version seen by searchSettleLeft
+  uint64_t version; // bumped whenever the results change meaning
+  struct searchview view;
+  int64_t index, index_cx, index_cy, index_done;
+  uint64_t index_version;
+  char prompt[80];
+
+  // worker pool, see search
+  pthread_t *threads;
+  int16_t nthreads;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t idle;
+  uint64_t gen;     // bumped to post or cancel a job
+  bool posted;
+  int16_t busy;     // workers inside the current job
+  int64_t next;     // next chunk to claim
+};
+
+typedef struct undorec {
+  int8_t type;      // UNDO_INSERT or UNDO_DELETE
+  uint64_t step;    // records of one step are undone together
+  int64_t y, x;     // where the text starts
+  int64_t len;
+  char *text;       // points into the log
+  size_t size;      // of the whole packed record
+} undorec;
+
+struct undolog {
+  char *buf;        // packed records, oldest first, see undo
+  size_t len, cap;
+  size_t pos;       // end of the done records, the rest can be redone
+  size_t limit;
+  uint64_t step;    // step of the newest record
+  bool open;        // the newest step still takes records
+  bool replaying;   // undo or redo is editing, record nothing
+  bool overflow;    // the open step outgrew the limit
+  int64_t cx, cy;   // cursor after the last key
+};
+
+struct swap {
+  char *path;       // NULL while edits aren't logged, see swap file
+  int fd;
+  char *buf;        // records not yet taken by the writer
+  size_t len, cap;
+  int64_t last;     // offset in buf of a trailing insert, or -1
+  int64_t ly, lx;   // where that insert ends
+  char *spare;      // the writer's last buffer, reused next time
+  size_t sparecap;
+  bool flush;       // the writer should take buf
+  bool reset;       // and truncate the file before writing it
+  int err;          // errno of the writer's last failure
+  int64_t due;      // when buf gets flushed, 0 while it's empty
+  bool started;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+};
+
+struct follow {
+  bool on;          // the file is shown read-only as it grows, see follow
+  int fd;
+  int ifd;          // inotify instance watching it
+  off_t off;        // bytes of the file already in the buffer
+  bool partial;     // the last row has no line break yet
+  bool more;        // stopped reading with data left
+};
+
+struct keyword {
+  const char *word;
+  uint8_t len;
+  uint8_t hl;       // HL_KEYWORD or HL_TYPE
+};
+
+struct syntax {
+  const char *name;
+  const char **match;       // file name extensions
+  const char **interp;      // interpreters named on a #! line
+  const char **keywords;
+  const char **types;
+  const char *linecomment;  // NULL if the language has none
+  const char *quotes;       // characters that open a string
+  int16_t flags;            // SYNTAX_* flags
+
+  // keywords and types hashed without collisions, see filetypes
+  struct keyword *table;
+  uint32_t mask, seed;
+  uint8_t minlen, maxlen;
+  bool stops[256];  // bytes that can change state in plain text
+};
+
 typedef enum EditorMode {
   MODE_NORMAL,
   MODE_INSERT
 } EditorMode;
 
 struct editorConfig {
-  int16_t cx, cy;
-  int16_t rx;       // x counting multi-column characters
-  int16_t rowoff;
-  int16_t coloff;
+  int64_t cx, cy;
+  int64_t rx;       // x counting multi-column characters
+  int64_t rowoff;
+  int64_t coloff;
   int16_t screenrows;
   int16_t screencols;
-  int16_t numrows;
-  erow *row;
-  uint16_t dirty;
+  int64_t numrows;
+  rownode *rows;    // root of the row tree, see row store
+  int64_t hlvalid;  // rows before this agree on syntax state
+  int64_t rendered; // rows holding render and hl
+  struct syntax *syntax;
+  char *map;        // read-only mapping of the opened file
+  size_t maplen;
+  size_t loaded;    // bytes of map indexed into rows, see editorLoadRows
+  bool mapdisk;     // map is of the file on disk, not one replaced since
+  struct stat disk; // that file as last opened or saved, see editorSave
+  uint64_t dirty;
   char linestart; // keep as char
   char *filename;
   /* for future:
@@ -83,12 +362,24 @@ struct editorConfig {
    */
   EditorMode mode;
   char statusmsg[80];
-  time_t statusmsg_time;
+  int64_t statusmsg_time;   // nowMillis() when the message was set
+  struct screen screen;
+  struct inputbuf input;
+  struct search search;
+  struct undolog undo;
+  struct swap swap;
+  struct follow follow;
+  int wakefd[2];    // self-pipe that interrupts the event loop
+  volatile sig_atomic_t resized;
   struct termios orig_termios;
 };
 
 struct editorConfig config;
 
+// rows being gathered for one editorInsertRows call. only one batch is
+// filled at a time, and at ROW_BATCH rows it is too big for the stack
+erow rowbatch[ROW_BATCH];
+
 enum EditorKey {
   BACKSPACE = 127,
   ARROW_LEFT = 1000,
@@ -100,6 +391,7 @@ enum EditorKey {
   KEY_HOME,
   KEY_END,
   KEY_DEL,
+  KEY_PASTE,        // start of a bracketed paste, see editorReadPaste
 };
 
 enum EditorHighlight {
@@ -110,14 +402,83 @@ enum EditorHighlight {
   HL_STRING,
   HL_MATCH,
   HL_ESCAPE,
+  HL_COMMENT,
+  HL_KEYWORD,
+  HL_TYPE,
+};
+
+// what a row leaves open for the next one
+enum SyntaxState {
+  HLS_NORMAL = 0,
+  HLS_COMMENT,      // a /* comment
+  HLS_DQUOTE,       // a string continued by a trailing backslash
+  HLS_SQUOTE,
+  HLS_DQUOTE3,      // a triple quoted string
+  HLS_SQUOTE3,
 };
 
 /*** prototypes ***/
 void editorSetStatusMessage(const char *fmt, ...);
+void editorWaitInput();
 void editorRefreshScreen();
 char *editorPrompt(char *prompt, size_t maxlen, void (*callback)(char *, int16_t));
 int8_t getCloseBrace(int8_t c);
 void editorScroll();
+void editorLoadAll();
+int16_t editorTextCols();
+erow *editorRowAt(int64_t at);
+erow *editorRowIterStart(rowiter *it, int64_t at);
+erow *editorRowIterNext(rowiter *it);
+void editorRowPrepare(erow *row);
+void editorWake();
+void searchInvalidate();
+bool searchCurrent(uint64_t gen);
+int64_t searchSettleLeft();
+void undoRecord(int8_t type, int64_t y, int64_t x, const char *text,
+                int64_t len);
+void swapRecord(int8_t type, int64_t y, int64_t x, const char *text,
+                int64_t len);
+int64_t nowMillis();
+int8_t writevAll(int fd, struct iovec *iov, int n);
+
+/*** append buffer ***/
+
+struct abuf {
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0};
+
+// grow by len bytes and return where they start, or NULL if out of memory
+char *abExtend(struct abuf *ab, size_t len) {
+  if (ab->len + len > ab->cap) {
+    size_t cap = ab->cap ? ab->cap : 4096;
+    while (cap < ab->len + len) cap *= 2;
+    char *new = realloc(ab->buf, cap);
+    if (new == NULL) return NULL;
+    ab->buf = new;
+    ab->cap = cap;
+  }
+  char *p = &ab->buf[ab->len];
+  ab->len += len;
+  return p;
+}
+
+void abAppend(struct abuf *ab, const char *s, size_t len) {
+  char *p = abExtend(ab, len);
+  if (p) memcpy(p, s, len);
+}
+
+// drop the contents but keep the allocation for the next user
+void abClear(struct abuf *ab) {
+  ab->len = 0;
+}
+
+void abFree(struct abuf *ab){
+  free(ab->buf);
+}
 
 /*** terminal ***/
 
@@ -130,6 +491,7 @@ void die(const char *s){
 }
 
 void disableRawMode() {
+  write(STDOUT_FILENO, PASTE_OFF_STRING, 8);
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &config.orig_termios) == -1)
     die("tcsetattr");
 }
@@ -148,60 +510,173 @@ void enableRawMode() {
   raw.c_oflag &= ~(OPOST);
   raw.c_cflag |=  (CS8);
 
+  // never block in read(), the event loop polls before reading
   raw.c_cc[VMIN]  = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
 
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
     die("tcsetattr");
+
+  // have pastes wrapped in ESC[200~ ... ESC[201~ so they skip key handling
+  write(STDOUT_FILENO, PASTE_ON_STRING, 8);
 }
 
-int16_t editorReadKey() {
-  int16_t nread;
-  int8_t c;
+/*
+ * input is read in whatever chunks the terminal hands over and parsed out
+ * of config.input one key at a time, so a paste costs one read() rather
+ * than one per byte and the caller can drain the whole batch before
+ * redrawing.
+ */
+
+// append what the terminal has ready, -1 if it had nothing and 0 on hangup
+int16_t editorFillInput() {
+  struct inputbuf *in = &config.input;
+
+  if (in->pos > 0) {
+    memmove(in->buf, &in->buf[in->pos], in->len - in->pos);
+    in->len -= in->pos;
+    in->pos = 0;
+  }
+  if (in->len == INPUT_BUF_SIZE) return -1;
 
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1){
-    if (nread == -1 && errno != EAGAIN) die("read");
+  ssize_t nread = read(STDIN_FILENO, &in->buf[in->len], INPUT_BUF_SIZE - in->len);
+  if (nread == -1) {
+    if (errno != EAGAIN && errno != EINTR) die("read");
+    return -1;
   }
-  
+  in->len += nread;
+  return nread;
+}
 
-  if (c == '\x1b') {
-   char seq[3];
-
-    if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-    if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-    if (seq[0] == '[') {
-      if (seq[1] >= '0' && seq[1] <= '9') {
-        if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-        if (seq[2] == '~'){
-          switch (seq[1]) {
-            case '1': return KEY_HOME;
-            case '3': return KEY_DEL;
-            case '4': return KEY_END;
-            case '5': return KEY_PAGE_UP;
-            case '6': return KEY_PAGE_DOWN;
-          }
-        }
-      } else {
-        switch (seq[1]) {
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT;
-          case 'H': return KEY_HOME;
-          case 'F': return KEY_END;
-        }
-      }
-    } else if (seq[0] == 'O') {
-      switch (seq[1]) {
-        case 'H': return KEY_HOME;
-        case 'F': return KEY_DEL;
-      }
+int16_t editorFillInputTimeout(int ms) {
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+  if (poll(&pfd, 1, ms) <= 0) return -1;
+  return editorFillInput();
+}
+
+bool editorKeysPending() {
+  return config.input.pos < config.input.len;
+}
+
+// byte i positions past the cursor, reading more if the sequence is split
+int16_t editorPeekInput(int16_t i) {
+  struct inputbuf *in = &config.input;
+  while (in->pos + i >= in->len)
+    if (editorFillInputTimeout(ESC_TIMEOUT_MS) <= 0) return -1;
+  return (unsigned char) in->buf[in->pos + i];
+}
+
+int16_t editorParseEscape() {
+  struct inputbuf *in = &config.input;
+  int16_t seq0 = editorPeekInput(1);
+  int16_t seq1 = editorPeekInput(2);
+
+  if (seq0 == -1 || seq1 == -1) {
+    in->pos++;
+    return '\x1b';
+  }
+
+  if (seq0 == 'O') {
+    in->pos += 3;
+    switch (seq1) {
+      case 'H': return KEY_HOME;
+      case 'F': return KEY_END;
     }
+    return '\x1b';
+  }
 
+  if (seq0 != '[') {
+    in->pos++;
+    return '\x1b';
+  }
+
+  // CSI: parameter bytes, intermediate bytes, then one final byte
+  int16_t len = 2;
+  int16_t param = 0;
+  bool first = 1;   // only the first parameter matters
+  int16_t c = seq1;
+  while (c >= 0x20 && c <= 0x3f) {
+    if (c == ';') first = 0;
+    else if (first && isdigit(c) && param < 1000) param = param * 10 + (c - '0');
+    c = editorPeekInput(++len);
+  }
+  if (c == -1) {
+    in->pos += len;
     return '\x1b';
   }
+  in->pos += len + 1;
+
+  switch (c) {
+    case 'A': return ARROW_UP;
+    case 'B': return ARROW_DOWN;
+    case 'C': return ARROW_RIGHT;
+    case 'D': return ARROW_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    case '~':
+      switch (param) {
+        case 1:
+        case 7: return KEY_HOME;
+        case 3: return KEY_DEL;
+        case 4:
+        case 8: return KEY_END;
+        case 5: return KEY_PAGE_UP;
+        case 6: return KEY_PAGE_DOWN;
+        case 200: return KEY_PASTE;
+      }
+  }
+
+  return '\x1b';
+}
+
+/*
+ * collect the body of a bracketed paste, called right after KEY_PASTE.
+ * gives up if the terminal goes quiet for a second without sending the
+ * end marker, so a lost marker cannot hang the editor.
+ */
+char *editorReadPaste(size_t *len) {
+  struct inputbuf *in = &config.input;
+  struct abuf ab = ABUF_INIT;
+  int16_t endlen = strlen(PASTE_END_STRING);
+  int16_t idle = 0;
+
+  while (idle < 10) {
+    char *start = &in->buf[in->pos];
+    size_t avail = in->len - in->pos;
+    char *end = memmem(start, avail, PASTE_END_STRING, endlen);
+    if (end) {
+      abAppend(&ab, start, end - start);
+      in->pos += end - start + endlen;
+      break;
+    }
+    // keep what could be the beginning of a split end marker
+    size_t take = avail > (size_t) endlen ? avail - endlen : 0;
+    abAppend(&ab, start, take);
+    in->pos += take;
+    idle = editorFillInputTimeout(100) > 0 ? 0 : idle + 1;
+  }
+  if (idle == 10) {
+    abAppend(&ab, &in->buf[in->pos], in->len - in->pos);
+    in->pos = in->len;
+  }
+
+  *len = ab.len;
+  return ab.buf;
+}
+
+int16_t editorReadKey() {
+  struct inputbuf *in = &config.input;
+
+  while (!editorKeysPending()) {
+    editorWaitInput();
+    // poll said readable, so nothing to read means the terminal is gone
+    if (editorFillInput() == 0) die("read");
+  }
+
+  char c = in->buf[in->pos];
+  if (c == '\x1b') return editorParseEscape();
 
+  in->pos++;
   return c;
 
 }
@@ -214,7 +689,9 @@ int16_t getCursorPosition(int16_t *rows, int16_t *cols) {
   if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) 
     return -1;
 
+  struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
   while (i < sizeof(buf) -1) {
+    if (poll(&pfd, 1, 1000) != 1) break;
     if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
     if (buf[i] == 'R') break;
     i++;
@@ -222,10 +699,13 @@ int16_t getCursorPosition(int16_t *rows, int16_t *cols) {
 
   buf[i] = '\0';
 
+  int r, c;
   if (buf[0] != '\x1b' || buf[1] != '[') return -1;
-  if (sscanf((char*) &buf[2], "%d;%d", (int*) rows, (int*) cols) != 2) return -1;
+  if (sscanf((char*) &buf[2], "%d;%d", &r, &c) != 2) return -1;
+  *rows = r;
+  *cols = c;
 
-  return -1;
+  return 0;
 
 }
 
@@ -233,7 +713,7 @@ int16_t getWindowSize(int16_t *rows, int16_t *cols){
   struct winsize ws;
 
   if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0){
-    if (write(STDOUT_FILENO, "\x1b[999C;\x1b[999B", 12) != 12) return -1;
+    if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
     return getCursorPosition(rows, cols);
   } else {
     *cols = ws.ws_col;
@@ -244,7 +724,243 @@ int16_t getWindowSize(int16_t *rows, int16_t *cols){
 }
 
 int8_t getCharUnderCursor(){
-  return config.row[config.cy].render[config.cx];
+  erow *row = editorRowAt(config.cy);
+  editorRowPrepare(row);
+  return row->render[config.cx];
+}
+
+/*** filetypes ***/
+
+const char *C_MATCH[] = {".c", ".h", NULL};
+const char *C_KEYWORDS[] = {
+  "auto", "break", "case", "const", "continue", "default", "do", "else",
+  "enum", "extern", "for", "goto", "if", "inline", "register", "restrict",
+  "return", "sizeof", "static", "struct", "switch", "typedef", "union",
+  "volatile", "while", "NULL", NULL
+};
+const char *C_TYPES[] = {
+  "bool", "char", "double", "float", "int", "long", "short", "signed",
+  "unsigned", "void", "size_t", "ssize_t", "ptrdiff_t", "off_t", "FILE",
+  "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t", "uint16_t",
+  "uint32_t", "uint64_t", "intptr_t", "uintptr_t", NULL
+};
+
+const char *CPP_MATCH[] = {
+  ".cpp", ".cc", ".cxx", ".c++", ".hpp", ".hh", ".hxx", NULL
+};
+const char *CPP_KEYWORDS[] = {
+  "alignas", "alignof", "break", "case", "catch", "class", "const",
+  "const_cast", "consteval", "constexpr", "continue", "co_await",
+  "co_return", "co_yield", "decltype", "default", "delete", "do",
+  "dynamic_cast", "else", "enum", "explicit", "export", "extern", "false",
+  "final", "for", "friend", "goto", "if", "inline", "mutable", "namespace",
+  "new", "noexcept", "nullptr", "operator", "override", "private",
+  "protected", "public", "reinterpret_cast", "return", "sizeof", "static",
+  "static_assert", "static_cast", "struct", "switch", "template", "this",
+  "throw", "true", "try", "typedef", "typeid", "typename", "union",
+  "using", "virtual", "volatile", "while", NULL
+};
+const char *CPP_TYPES[] = {
+  "auto", "bool", "char", "char8_t", "char16_t", "char32_t", "double",
+  "float", "int", "long", "short", "signed", "unsigned", "void", "wchar_t",
+  "size_t", "ptrdiff_t", "int8_t", "int16_t", "int32_t", "int64_t",
+  "uint8_t", "uint16_t", "uint32_t", "uint64_t", "std", "string",
+  "string_view", "vector", "map", "unordered_map", "set", "array",
+  "unique_ptr", "shared_ptr", NULL
+};
+
+const char *PY_MATCH[] = {".py", ".pyw", ".pyi", NULL};
+const char *PY_INTERP[] = {"python", NULL};
+const char *PY_KEYWORDS[] = {
+  "and", "as", "assert", "async", "await", "break", "class", "continue",
+  "def", "del", "elif", "else", "except", "finally", "for", "from",
+  "global", "if", "import", "in", "is", "lambda", "nonlocal", "not", "or",
+  "pass", "raise", "return", "try", "while", "with", "yield", "match",
+  "case", "True", "False", "None", "self", NULL
+};
+const char *PY_TYPES[] = {
+  "bool", "bytearray", "bytes", "complex", "dict", "float", "frozenset",
+  "int", "list", "object", "range", "set", "str", "tuple", "type", NULL
+};
+
+const char *SH_MATCH[] = {".sh", ".bash", ".zsh", ".ksh", NULL};
+const char *SH_INTERP[] = {"sh", "bash", "zsh", "dash", "ksh", NULL};
+const char *SH_KEYWORDS[] = {
+  "if", "then", "else", "elif", "fi", "case", "esac", "for", "select",
+  "while", "until", "do", "done", "in", "function", "time", "return",
+  "break", "continue", "exit", NULL
+};
+const char *SH_TYPES[] = {
+  "alias", "cd", "declare", "echo", "eval", "exec", "export", "local",
+  "printf", "read", "readonly", "set", "shift", "source", "test", "trap",
+  "typeset", "unset", NULL
+};
+
+const char *JSON_MATCH[] = {".json", NULL};
+const char *JSON_KEYWORDS[] = {"true", "false", "null", NULL};
+
+const char *YAML_MATCH[] = {".yaml", ".yml", NULL};
+const char *YAML_KEYWORDS[] = {
+  "true", "false", "True", "False", "TRUE", "FALSE", "yes", "no", "on",
+  "off", "null", "Null", "NULL", NULL
+};
+
+// the first entry is plain text, for files nothing else matches
+struct syntax syntaxdb[] = {
+  {"text", NULL, NULL, NULL, NULL, NULL, "\"'", 0,
+   NULL, 0, 0, 0, 0, {0}},
+  {"c", C_MATCH, NULL, C_KEYWORDS, C_TYPES, "//", "\"'",
+   SYNTAX_BLOCK_COMMENTS, NULL, 0, 0, 0, 0, {0}},
+  {"c++", CPP_MATCH, NULL, CPP_KEYWORDS, CPP_TYPES, "//", "\"'",
+   SYNTAX_BLOCK_COMMENTS, NULL, 0, 0, 0, 0, {0}},
+  {"python", PY_MATCH, PY_INTERP, PY_KEYWORDS, PY_TYPES, "#", "\"'",
+   SYNTAX_TRIPLE_QUOTES, NULL, 0, 0, 0, 0, {0}},
+  {"shell", SH_MATCH, SH_INTERP, SH_KEYWORDS, SH_TYPES, "#", "\"'", 0,
+   NULL, 0, 0, 0, 0, {0}},
+  {"json", JSON_MATCH, NULL, JSON_KEYWORDS, NULL, NULL, "\"", 0,
+   NULL, 0, 0, 0, 0, {0}},
+  {"yaml", YAML_MATCH, NULL, YAML_KEYWORDS, NULL, "#", "\"'", 0,
+   NULL, 0, 0, 0, 0, {0}},
+};
+
+#define SYNTAXDB_ENTRIES (sizeof(syntaxdb) / sizeof(syntaxdb[0]))
+
+/*
+ * keywords and types of a filetype go into one table, sized a power of
+ * two at least twice their number, and a seed is searched for that
+ * hashes every word to a slot of its own. looking a word up is then one
+ * hash and at most one compare, however long the lists get.
+ */
+
+uint32_t syntaxHash(const char *s, int64_t len, uint32_t seed) {
+  uint32_t h = 2166136261u ^ seed;
+  for (int64_t i = 0; i < len; i++) {
+    h ^= (uint8_t) s[i];
+    h *= 16777619u;
+  }
+  return h ^ (h >> 16);
+}
+
+bool syntaxFill(struct syntax *syn, uint32_t seed) {
+  const char **lists[2] = {syn->keywords, syn->types};
+  memset(syn->table, 0, (syn->mask + 1) * sizeof(struct keyword));
+  for (int16_t l = 0; l < 2; l++) {
+    for (const char **w = lists[l]; w && *w; w++) {
+      uint8_t len = strlen(*w);
+      struct keyword *k = &syn->table[syntaxHash(*w, len, seed) & syn->mask];
+      if (k->word) return 0;
+      k->word = *w;
+      k->len = len;
+      k->hl = l == 0 ? HL_KEYWORD : HL_TYPE;
+      syn->minlen = MIN(syn->minlen, len);
+      syn->maxlen = MAX(syn->maxlen, len);
+    }
+  }
+  syn->seed = seed;
+  return 1;
+}
+
+void syntaxBuildTable(struct syntax *syn) {
+  for (const char *q = syn->quotes; *q; q++) syn->stops[(uint8_t) *q] = 1;
+  if (syn->linecomment) syn->stops[(uint8_t) syn->linecomment[0]] = 1;
+  if (syn->flags & SYNTAX_BLOCK_COMMENTS) syn->stops['/'] = 1;
+
+  uint32_t n = 0;
+  for (const char **w = syn->keywords; w && *w; w++) n++;
+  for (const char **w = syn->types; w && *w; w++) n++;
+  if (syn->table || n == 0) return;
+
+  uint32_t size = 1;
+  while (size < n * 2) size *= 2;
+  for (;;) {
+    syn->table = malloc(size * sizeof(struct keyword));
+    syn->mask = size - 1;
+    syn->minlen = UINT8_MAX;
+    syn->maxlen = 0;
+    for (uint32_t seed = 1; seed <= 4096; seed++)
+      if (syntaxFill(syn, seed)) return;
+    free(syn->table);
+    size *= 2;
+  }
+}
+
+// HL_KEYWORD or HL_TYPE if s is one in the current filetype
+uint8_t syntaxKeyword(const char *s, int64_t len) {
+  struct syntax *syn = config.syntax;
+  if (syn->table == NULL || len < syn->minlen || len > syn->maxlen)
+    return HL_NORMAL;
+  struct keyword *k = &syn->table[syntaxHash(s, len, syn->seed) & syn->mask];
+  if (k->word && k->len == len && memcmp(k->word, s, len) == 0)
+    return k->hl;
+  return HL_NORMAL;
+}
+
+// the interpreter a #! line runs, looking through env
+const char *syntaxInterpreter(erow *row, int64_t *len) {
+  if (row->size < 2 || row->chars[0] != '#' || row->chars[1] != '!')
+    return NULL;
+  const char *p = &row->chars[2], *end = &row->chars[row->size];
+  const char *word = NULL, *base = NULL;
+
+  while (p < end) {
+    while (p < end && isspace((unsigned char) *p)) p++;
+    word = base = p;
+    while (p < end && !isspace((unsigned char) *p)) {
+      if (*p == '/') base = p + 1;
+      p++;
+    }
+    *len = p - base;
+    bool env = *len == 3 && memcmp(base, "env", 3) == 0;
+    if (!env && *word != '-') break;
+  }
+  return *len > 0 ? base : NULL;
+}
+
+// python3 and python3.12 run python
+bool syntaxInterpMatches(const char *name, int64_t len, const char *interp) {
+  int64_t n = strlen(interp);
+  if (len < n || memcmp(name, interp, n) != 0) return 0;
+  while (n < len && (isdigit((unsigned char) name[n]) || name[n] == '.')) n++;
+  return n == len;
+}
+
+/*
+ * pick the filetype by the file name's extension, or failing that by
+ * the interpreter on a #! first line. rows highlighted under the old
+ * rules are dropped back to undrawn.
+ */
+void editorSelectSyntax() {
+  struct syntax *syn = &syntaxdb[0];
+  const char *slash = config.filename ? strrchr(config.filename, '/') : NULL;
+  const char *base = slash ? slash + 1 : config.filename;
+  const char *ext = base ? strrchr(base, '.') : NULL;
+  int64_t ilen = 0;
+  const char *interp = config.numrows > 0 ?
+    syntaxInterpreter(editorRowAt(0), &ilen) : NULL;
+
+  for (size_t i = 1; i < SYNTAXDB_ENTRIES && syn == &syntaxdb[0]; i++) {
+    for (const char **m = syntaxdb[i].match; ext && m && *m; m++)
+      if (strcmp(ext, *m) == 0) syn = &syntaxdb[i];
+  }
+  for (size_t i = 1; i < SYNTAXDB_ENTRIES && syn == &syntaxdb[0]; i++) {
+    for (const char **m = syntaxdb[i].interp; interp && m && *m; m++)
+      if (syntaxInterpMatches(interp, ilen, *m)) syn = &syntaxdb[i];
+  }
+
+  if (syn == config.syntax) return;
+  config.syntax = syn;
+  syntaxBuildTable(syn);
+
+  rowiter it;
+  for (erow *row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)) {
+    free(row->render);
+    free(row->hl);
+    row->render = NULL;
+    row->hl = NULL;
+    row->hlscan = 0;
+  }
+  config.hlvalid = 0;
+  config.rendered = 0;
 }
 
 /*** syntax hightlighting ***/
@@ -253,62 +969,255 @@ bool is_separator(int16_t c) {
   return isspace(c) || c == '\0' || strchr("\",.()+-/*=~%<>[];", c) != NULL;
 }
 
-bool is_string_brace(int16_t c) {
-  return strchr("'\"", c) != NULL;
-}
-
 bool is_brace(int16_t c){
   return strchr("()[]{}<>", c) != NULL;
 }
 
-void editorUpdateSyntax(erow *row) {
-  row->hl = realloc(row->hl, row->rsize);
-  memset(row->hl, HL_NORMAL, row->rsize);
-
-  bool prev_is_sep = 1;
-  int16_t last_string_brace = 0;
-  int16_t prev_c = 0;
+// a # only starts a comment at the start of a word, so $# stays code
+bool syntaxLineComment(const char *lc, char c, char next, bool word) {
+  if (lc == NULL || c != lc[0]) return 0;
+  return lc[1] ? next == lc[1] : word;
+}
 
-  int16_t i = 0;
-  while (i < row->rsize){
-    int8_t c = row->render[i];
-    uint8_t prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;   
-
-    if (is_string_brace(c)){
-      row->hl[i] = HL_STRING;
-      if (last_string_brace && c == last_string_brace) {
-        last_string_brace = 0;
-      } else if (last_string_brace == 0){
-        last_string_brace = c; 
+/*
+ * tokenize s[from, len) into hl, starting in syntax state st, and return
+ * the state the line leaves open. once past sync it stops as soon as it
+ * is in plain text and agrees with what hl already held, since the rest
+ * of the line would come out the same; it returns -1 then, the end
+ * state being what it was.
+ */
+int16_t syntaxTokenize(const char *s, char *hl, int64_t len, int64_t from,
+                       int64_t sync, uint8_t st) {
+  struct syntax *syn = config.syntax;
+  const char *lc = syn->linecomment;
+  int16_t quote = st == HLS_DQUOTE || st == HLS_DQUOTE3 ? '"'
+                : st == HLS_SQUOTE || st == HLS_SQUOTE3 ? '\'' : 0;
+  bool triple = st == HLS_DQUOTE3 || st == HLS_SQUOTE3;
+  bool comment = st == HLS_COMMENT;
+  bool cont = 0;    // a string runs into the next line
+
+  int16_t prev_c = from > 0 ? s[from - 1] : 0;
+  bool prev_is_sep = is_separator(prev_c);
+  char old_hl = HL_NORMAL;
+
+  int64_t i = from;
+  while (i < len){
+    if (i > sync && !quote && !comment && hl[i - 1] == old_hl
+        && old_hl != HL_STRING && old_hl != HL_ESCAPE && old_hl != HL_COMMENT)
+      return -1;
+
+    int8_t c = s[i];
+    int8_t next = i + 1 < len ? s[i + 1] : 0;
+    uint8_t prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;   
+    old_hl = hl[i];
+    hl[i] = HL_NORMAL;
+
+    if (comment) {
+      hl[i] = HL_COMMENT;
+      if (c == '*' && next == '/') {
+        hl[++i] = HL_COMMENT;
+        comment = 0;
       }
-    } else if (last_string_brace) {
-      row->hl[i] = HL_STRING;
-      if ((c == '\\' || c == '%') && i + 1 < row->rsize){
-        row->hl[i] = HL_ESCAPE;
+    } else if (quote) {
+      hl[i] = HL_STRING;
+      if ((c == '\\' || c == '%') && i + 1 < len){
+        hl[i] = HL_ESCAPE;
         i++;
-        row->hl[i] = HL_ESCAPE;
-        if (c == '\\' && row->render[i] == 'x') {
-          row->hl[i + 1] = HL_ESCAPE;
-          row->hl[i + 2] = HL_ESCAPE;
+        hl[i] = HL_ESCAPE;
+        if (c == '\\' && s[i] == 'x' && i + 2 < len) {
+          hl[i + 1] = HL_ESCAPE;
+          hl[i + 2] = HL_ESCAPE;
           i+=2;
         }
+      } else if (c == '\\') {
+        cont = 1;
+      } else if (c == quote && !triple) {
+        quote = 0;
+      } else if (c == quote && next == c && i + 2 < len && s[i + 2] == c) {
+        hl[i + 1] = hl[i + 2] = HL_STRING;
+        i += 2;
+        quote = 0;
+      }
+    } else if (syntaxLineComment(lc, c, next, prev_is_sep)) {
+      memset(&hl[i], HL_COMMENT, len - i);
+      return HLS_NORMAL;
+    } else if ((syn->flags & SYNTAX_BLOCK_COMMENTS) && c == '/'
+               && next == '*') {
+      hl[i] = hl[i + 1] = HL_COMMENT;
+      i++;
+      comment = 1;
+    } else if (c != '\0' && strchr(syn->quotes, c)){
+      hl[i] = HL_STRING;
+      quote = c;
+      triple = (syn->flags & SYNTAX_TRIPLE_QUOTES) && next == c
+        && i + 2 < len && s[i + 2] == c;
+      if (triple) {
+        hl[i + 1] = hl[i + 2] = HL_STRING;
+        i += 2;
       }
+    } else if (syn->table && prev_is_sep
+               && (isalpha((unsigned char) c) || c == '_')) {
+      // whole words at a time, keyword or not
+      int64_t end = i + 1;
+      while (end < len && (isalnum((unsigned char) s[end]) || s[end] == '_'))
+        end++;
+      if (end - 1 > i) old_hl = hl[end - 1];
+      memset(&hl[i], syntaxKeyword(&s[i], end - i), end - i);
+      prev_is_sep = 0;
+      prev_c = s[end - 1];
+      i = end;
+      continue;
     } else if ((isdigit(c) && (prev_is_sep || prev_hl == HL_NUMBER))
       || (c == '.' && prev_hl == HL_NUMBER)
       || (isxdigit(c) && prev_hl == HL_NUMBER)
       || (prev_c == '0' && prev_hl == HL_NUMBER && c == 'x')) {
-      row->hl[i] = HL_NUMBER;
+      hl[i] = HL_NUMBER;
       prev_is_sep = 0;
     } else if (c == '*') {
-      row->hl[i] = HL_STAR;
+      hl[i] = HL_STAR;
     } else if (is_brace(c)) {
-      row->hl[i] = HL_BRACE; 
+      hl[i] = HL_BRACE; 
     }
   
     prev_is_sep = is_separator(c);
     prev_c = c;
     i++;
   }
+
+  if (comment) return HLS_COMMENT;
+  if (quote && triple) return quote == '"' ? HLS_DQUOTE3 : HLS_SQUOTE3;
+  if (quote && cont) return quote == '"' ? HLS_DQUOTE : HLS_SQUOTE;
+  return HLS_NORMAL;
+}
+
+/*
+ * re-tokenize row->hl from position from onwards. the tokenizer can
+ * restart anywhere outside a string, comment or word, and one character
+ * early in case from completes a two character comment opener. only at the
+ * start of the row does it need the state the row above left open.
+ */
+void editorHighlightFrom(erow *row, int64_t from, int64_t sync) {
+  while (from > 0 && (row->hl[from - 1] == HL_STRING
+                      || row->hl[from - 1] == HL_ESCAPE
+                      || row->hl[from - 1] == HL_COMMENT))
+    from--;
+  if (from > 0) from--;
+  // and at the start of a word, which may have just become a keyword
+  while (from > 0 && (isalnum((unsigned char) row->render[from - 1])
+                      || row->render[from - 1] == '_'))
+    from--;
+
+  uint8_t st = from == 0 ? row->hlin : HLS_NORMAL;
+  int16_t out = syntaxTokenize(row->render, row->hl, row->rsize, from,
+                               sync, st);
+  if (out != -1) row->hlout = out;
+}
+
+void editorUpdateSyntax(erow *row) {
+  row->hl = realloc(row->hl, row->rsize + 1);
+  row->hlout = syntaxTokenize(row->render, row->hl, row->rsize, 0,
+                              row->rsize, row->hlin);
+  row->hlscan = 1;
+}
+
+/*
+ * just the state a line leaves open, as syntaxTokenize works it out but
+ * without classifying anything else, for rows that were never drawn.
+ * tabs tokenize like the spaces they render as, so chars will do.
+ */
+uint8_t syntaxScan(const char *s, int64_t len, uint8_t st) {
+  struct syntax *syn = config.syntax;
+  const char *lc = syn->linecomment;
+  int16_t quote = st == HLS_DQUOTE || st == HLS_DQUOTE3 ? '"'
+                : st == HLS_SQUOTE || st == HLS_SQUOTE3 ? '\'' : 0;
+  bool triple = st == HLS_DQUOTE3 || st == HLS_SQUOTE3;
+  bool comment = st == HLS_COMMENT;
+  bool cont = 0;
+
+  for (int64_t i = 0; i < len; i++) {
+    if (!quote && !comment) {
+      while (i < len && !syn->stops[(uint8_t) s[i]]) i++;
+      if (i == len) break;
+    }
+    char c = s[i];
+    char next = i + 1 < len ? s[i + 1] : 0;
+    if (comment) {
+      const char *star = memchr(&s[i], '*', len - i);
+      if (star == NULL) break;
+      i = star - s;
+      if (i + 1 < len && s[i + 1] == '/') {
+        i++;
+        comment = 0;
+      }
+    } else if (quote) {
+      if ((c == '\\' || c == '%') && i + 1 < len) {
+        i++;
+        if (c == '\\' && s[i] == 'x' && i + 2 < len) i += 2;
+      } else if (c == '\\') {
+        cont = 1;
+      } else if (c == quote && !triple) {
+        quote = 0;
+      } else if (c == quote && next == c && i + 2 < len && s[i + 2] == c) {
+        i += 2;
+        quote = 0;
+      }
+    } else if (syntaxLineComment(lc, c, next,
+                                 i == 0 || is_separator(s[i - 1]))) {
+      return HLS_NORMAL;
+    } else if ((syn->flags & SYNTAX_BLOCK_COMMENTS) && c == '/'
+               && next == '*') {
+      i++;
+      comment = 1;
+    } else if (c != '\0' && strchr(syn->quotes, c)) {
+      quote = c;
+      triple = (syn->flags & SYNTAX_TRIPLE_QUOTES) && next == c
+        && i + 2 < len && s[i + 2] == c;
+      if (triple) i += 2;
+    }
+  }
+
+  if (comment) return HLS_COMMENT;
+  if (quote && triple) return quote == '"' ? HLS_DQUOTE3 : HLS_SQUOTE3;
+  if (quote && cont) return quote == '"' ? HLS_DQUOTE : HLS_SQUOTE;
+  return HLS_NORMAL;
+}
+
+/*
+ * row y is about to change, so its end state may too. rows from it on
+ * get their start states checked again before they are drawn.
+ */
+void editorSyntaxInvalidate(erow *row, int64_t y) {
+  if (row->render == NULL) row->hlscan = 0;
+  config.hlvalid = MIN(config.hlvalid, y);
+}
+
+/*
+ * give every row before upto the state the row above it left open. the
+ * walk starts at the first row that might disagree and re-tokenizes a
+ * row only if its start state changed, so after an edit the change runs
+ * on just until some row ends in the same state as before.
+ */
+void editorSyntaxSync(int64_t upto) {
+  upto = MIN(upto, config.numrows);
+  int64_t y = config.hlvalid;
+  if (y >= upto) return;
+
+  uint8_t st = y > 0 ? editorRowAt(y - 1)->hlout : HLS_NORMAL;
+  rowiter it;
+  for (erow *row = editorRowIterStart(&it, y); row && y < upto;
+       row = editorRowIterNext(&it), y++) {
+    if (!row->hlscan || row->hlin != st) {
+      row->hlin = st;
+      if (row->render) {
+        editorUpdateSyntax(row);
+      } else {
+        row->hlout = syntaxScan(row->chars, row->size, row->hlin);
+        row->hlscan = 1;
+      }
+    }
+    st = row->hlout;
+  }
+  config.hlvalid = y;
 }
 
 int16_t isCharOpen(int16_t c){
@@ -343,15 +1252,222 @@ int16_t editorSyntaxToColor(int16_t hl){
     case HL_BRACE : return 33;
     case HL_MATCH : return 34;
     case HL_STAR  : return 35;
+    case HL_COMMENT: return 90;
+    case HL_KEYWORD: return 93;
+    case HL_TYPE  : return 96;
     default       : return 37;
   }
 }
 
+/*** row store ***/
+
+/*
+ * rows live in a counted b+tree: leaves hold up to ROWS_PER_LEAF rows
+ * inline, inner nodes hold up to NODE_CHILDREN children and every node
+ * knows how many rows are below it. finding row n, inserting and deleting
+ * rows are O(log n) plus a memmove inside a single leaf.
+ */
+
+rownode *rowNewNode(bool leaf) {
+  rownode *node = calloc(1, sizeof(rownode));
+  if (node == NULL) die("calloc");
+  node->leaf = leaf;
+  if (leaf) {
+    node->rows = malloc(sizeof(erow) * ROWS_PER_LEAF);
+    if (node->rows == NULL) die("malloc");
+  }
+  return node;
+}
+
+// free a subtree, what the rows point to is the caller's
+void rowFreeNode(rownode *node) {
+  if (node->leaf) free(node->rows);
+  else for (int16_t i = 0; i < node->n; i++) rowFreeNode(node->child[i]);
+  free(node);
+}
+
+void rowAddCount(rownode *node, int64_t delta) {
+  for (; node; node = node->parent) node->count += delta;
+}
+
+// leaf holding row at, at == numrows gives the end of the last leaf
+rownode *rowFindLeaf(int64_t at, int16_t *idx) {
+  rownode *node = config.rows;
+  while (!node->leaf) {
+    int16_t i;
+    for (i = 0; i < node->n - 1; i++) {
+      if (at < node->child[i]->count) break;
+      at -= node->child[i]->count;
+    }
+    node = node->child[i];
+  }
+  *idx = at;
+  return node;
+}
+
+erow *editorRowAt(int64_t at) {
+  if (at < 0 || at >= config.numrows) return NULL;
+  int16_t idx;
+  rownode *leaf = rowFindLeaf(at, &idx);
+  return &leaf->rows[idx];
+}
+
+erow *editorRowIterStart(rowiter *it, int64_t at) {
+  if (at < 0 || at >= config.numrows) return NULL;
+  it->leaf = rowFindLeaf(at, &it->idx);
+  return &it->leaf->rows[it->idx];
+}
+
+erow *editorRowIterNext(rowiter *it) {
+  if (++it->idx >= it->leaf->n) {
+    it->leaf = it->leaf->next;
+    it->idx = 0;
+    if (it->leaf == NULL) return NULL;
+  }
+  return &it->leaf->rows[it->idx];
+}
+
+int16_t rowChildIndex(rownode *parent, rownode *child) {
+  int16_t i = 0;
+  while (parent->child[i] != child) i++;
+  return i;
+}
+
+// put sibling right after node under node's parent, splitting upwards
+void rowInsertSibling(rownode *node, rownode *sibling) {
+  rownode *parent = node->parent;
+
+  if (parent == NULL) {
+    parent = rowNewNode(0);
+    parent->child[0] = node;
+    parent->n = 1;
+    parent->count = node->count;
+    node->parent = parent;
+    config.rows = parent;
+  }
+
+  if (parent->n == NODE_CHILDREN) {
+    rownode *split = rowNewNode(0);
+    int16_t half = NODE_CHILDREN / 2;
+    for (int16_t i = half; i < NODE_CHILDREN; i++) {
+      rownode *child = parent->child[i];
+      split->child[split->n++] = child;
+      split->count += child->count;
+      child->parent = split;
+    }
+    parent->n = half;
+    rowAddCount(parent, -split->count);
+    rowInsertSibling(parent, split);
+    if (node->parent == split) parent = split;
+  }
+
+  int16_t at = rowChildIndex(parent, node) + 1;
+  memmove(&parent->child[at + 1], &parent->child[at],
+          sizeof(rownode*) * (parent->n - at));
+  parent->child[at] = sibling;
+  parent->n++;
+  sibling->parent = parent;
+  rowAddCount(parent, sibling->count);
+}
+
+// move rows [idx, n) of leaf into a new leaf right after it
+rownode *rowSplitLeaf(rownode *leaf, int16_t idx) {
+  rownode *next = rowNewNode(1);
+  next->n = leaf->n - idx;
+  memcpy(next->rows, &leaf->rows[idx], sizeof(erow) * next->n);
+  leaf->n = idx;
+  rowAddCount(leaf, -next->n);
+  next->count = next->n;
+
+  next->prev = leaf;
+  next->next = leaf->next;
+  if (leaf->next) leaf->next->prev = next;
+  leaf->next = next;
+
+  rowInsertSibling(leaf, next);
+  return next;
+}
+
+void rowStoreInsert(int64_t at, erow *rows, int64_t n) {
+  int16_t idx;
+  rownode *leaf = rowFindLeaf(at, &idx);
+
+  while (n > 0) {
+    if (leaf->n == ROWS_PER_LEAF) {
+      rownode *next = rowSplitLeaf(leaf, idx);
+      if (idx == ROWS_PER_LEAF) {
+        leaf = next;
+        idx = 0;
+      }
+    }
+    int64_t k = MIN(n, ROWS_PER_LEAF - leaf->n);
+    memmove(&leaf->rows[idx + k], &leaf->rows[idx],
+            sizeof(erow) * (leaf->n - idx));
+    memcpy(&leaf->rows[idx], rows, sizeof(erow) * k);
+    leaf->n += k;
+    rowAddCount(leaf, k);
+    idx += k;
+    rows += k;
+    n -= k;
+  }
+}
+
+// unlink an empty node from its parent, dropping parents that empty out
+void rowRemoveNode(rownode *node) {
+  rownode *parent = node->parent;
+  int16_t at = rowChildIndex(parent, node);
+
+  if (node->leaf) {
+    if (node->prev) node->prev->next = node->next;
+    if (node->next) node->next->prev = node->prev;
+    free(node->rows);
+  }
+  free(node);
+
+  memmove(&parent->child[at], &parent->child[at + 1],
+          sizeof(rownode*) * (parent->n - at - 1));
+  parent->n--;
+
+  if (parent->n == 0 && parent->parent) rowRemoveNode(parent);
+}
+
+void rowStoreRemove(int64_t at) {
+  int16_t idx;
+  rownode *leaf = rowFindLeaf(at, &idx);
+
+  memmove(&leaf->rows[idx], &leaf->rows[idx + 1],
+          sizeof(erow) * (leaf->n - idx - 1));
+  leaf->n--;
+  rowAddCount(leaf, -1);
+
+  if (leaf->n == 0 && leaf->parent) {
+    rowRemoveNode(leaf);
+  } else if (leaf->next && leaf->next->parent == leaf->parent
+             && leaf->n + leaf->next->n <= ROWS_PER_LEAF / 2) {
+    // fold a sparse neighbour in so deletions don't leave a trail of
+    // nearly empty leaves behind
+    rownode *next = leaf->next;
+    memcpy(&leaf->rows[leaf->n], next->rows, sizeof(erow) * next->n);
+    leaf->n += next->n;
+    leaf->count += next->n;
+    next->n = 0;
+    next->count = 0;
+    rowRemoveNode(next);
+  }
+
+  while (!config.rows->leaf && config.rows->n == 1) {
+    rownode *root = config.rows;
+    config.rows = root->child[0];
+    config.rows->parent = NULL;
+    free(root);
+  }
+}
+
 /*** row operations ***/
 
-int16_t editorRowCxToRx(erow *row, int16_t cx) {
-  int16_t rx = 0;
-  for (int16_t i = 0; i < cx; i++){
+// render column of cx, carrying on from column from at render column rx
+int64_t editorRowCxToRxFrom(erow *row, int64_t cx, int64_t from, int64_t rx) {
+  for (int64_t i = from; i < cx; i++){
     if (row->chars[i] == '\t')
       rx += (TAB_STOP - 1) - (rx % TAB_STOP);
     rx++;
@@ -359,8 +1475,12 @@ int16_t editorRowCxToRx(erow *row, int16_t cx) {
   return rx;
 }
 
-int16_t editorRowRxToCx(erow *row, int16_t rx) {
-  int16_t cur_rx = 0, cx = 0;
+int64_t editorRowCxToRx(erow *row, int64_t cx) {
+  return editorRowCxToRxFrom(row, cx, 0, 0);
+}
+
+int64_t editorRowRxToCx(erow *row, int64_t rx) {
+  int64_t cur_rx = 0, cx = 0;
   for (cx = 0; cx < row->size; cx++){
     if (row->chars[cx] == '\t')
       cur_rx += (TAB_STOP - 1) - (cur_rx % TAB_STOP);
@@ -371,17 +1491,22 @@ int16_t editorRowRxToCx(erow *row, int16_t rx) {
   return cx;
 }
 
-void editorUpdateRow(erow *row) {
-  int16_t tabs = 0;
+int64_t countTabs(char *s, int64_t len) {
+  int64_t tabs = 0;
+  for (char *end = s + len; (s = memchr(s, '\t', end - s)); s++) tabs++;
+  return tabs;
+}
 
-  for (int16_t i = 0; i < row->size; i++)
-    if (row->chars[i] == '\t') tabs++;
+void editorUpdateRow(erow *row) {
+  int64_t tabs = countTabs(row->chars, row->size);
+  row->tabs = tabs;
 
+  if (row->render == NULL) config.rendered++;
   free(row->render);
   row->render = malloc(row->size + tabs*(TAB_STOP - 1) + 1);
 
-  int16_t idx = 0;
-  for (int16_t i = 0; i < row->size; i++) {
+  int64_t idx = 0;
+  for (int64_t i = 0; i < row->size; i++) {
     if (row->chars[i] == '\t') {
       row->render[idx++] = ' ';
       while (idx % TAB_STOP != 0) row->render[idx++] = ' ';
@@ -397,70 +1522,173 @@ void editorUpdateRow(erow *row) {
   
 }
 
-void editorInsertRow(int16_t at, char *s, size_t len){
-  if (at < 0 || at > config.numrows) return;
+void editorRowPrepare(erow *row) {
+  if (row->render == NULL) editorUpdateRow(row);
+}
+
+/*
+ * chars[at, at + ins) replaced del characters that used to start at at.
+ * while the row has no tabs render is a copy of chars, so both render and
+ * hl can be patched in place and re-tokenized from at until the
+ * highlighter catches up with the old state. tabs can shift every column
+ * after them, so those rows are rebuilt in full.
+ */
+void editorUpdateRowSpan(erow *row, int64_t at, int64_t ins, int64_t del) {
+  if (row->render == NULL) return;   // not drawn yet, built on demand
+
+  int64_t oldsize = row->rsize;
+  if (row->tabs != 0 || oldsize != row->size - ins + del) {
+    editorUpdateRow(row);
+    return;
+  }
+
+  if (ins != del) {
+    int64_t cap = MAX(oldsize, row->size);
+    row->render = realloc(row->render, cap + 1);
+    row->hl = realloc(row->hl, cap + 1);
+    memmove(&row->hl[at + ins], &row->hl[at + del], oldsize - at - del);
+  }
+  memcpy(&row->render[at], &row->chars[at], row->size - at + 1);
+  row->rsize = row->size;
 
-  config.row = realloc(config.row, sizeof(erow) * (config.numrows + 1));
-  memmove(&config.row[at + 1], &config.row[at],
-          sizeof(erow) * (config.numrows - at));
+  editorHighlightFrom(row, at, at + ins);
+}
+
+// give a row borrowing from the mapping its own copy of chars
+void editorRowCopy(erow *row) {
+  if (!row->mapped) return;
+  char *chars = malloc(row->size + 1);
+  memcpy(chars, row->chars, row->size);
+  chars[row->size] = '\0';
+  row->chars = chars;
+  row->mapped = 0;
+}
 
-  config.row = (erow*) realloc(config.row, sizeof(erow) * (config.numrows + 1));
+void editorRowOwn(erow *row, int64_t y) {
+  searchInvalidate();
+  editorSyntaxInvalidate(row, y);
+  editorRowCopy(row);
+  row->modified = 1;
+}
 
-  config.row[at].size = len;
-  config.row[at].chars = malloc(len + 1);
-  memcpy(config.row[at].chars, s, len);
-  config.row[at].chars[len] = '\0';
+void editorInitRow(erow *row, char *chars, size_t len, bool mapped) {
+  row->size = len;
+  row->rsize = 0;
+  row->chars = chars;
+  row->render = NULL;
+  row->hl = NULL;
+  row->tabs = 0;
+  row->mapped = mapped;
+  row->hlin = HLS_NORMAL;
+  row->hlout = HLS_NORMAL;
+  row->hlscan = 0;
+  row->modified = !mapped;
+}
 
-  config.row[at].rsize = 0;
-  config.row[at].render = NULL;
-  config.row[at].hl = NULL;
+// move n already initialised rows into the buffer before row at
+void editorInsertRows(int64_t at, erow *rows, int64_t n) {
+  if (at < 0 || at > config.numrows || n <= 0) return;
 
-  editorUpdateRow(&config.row[at]);
+  searchInvalidate();
+  rowStoreInsert(at, rows, n);
+  config.hlvalid = MIN(config.hlvalid, at);
 
-  config.numrows++;
+  config.numrows += n;
   config.dirty++;
 }
 
+void editorInsertRow(int64_t at, char *s, size_t len){
+  if (at < 0 || at > config.numrows) return;
+
+  erow row;
+  char *chars = malloc(len + 1);
+  memcpy(chars, s, len);
+  chars[len] = '\0';
+  editorInitRow(&row, chars, len, 0);
+
+  editorInsertRows(at, &row, 1);
+}
+
 void editorFreeRow(erow *row) {
+  if (row->render) config.rendered--;
   free(row->render);
-  free(row->chars);
+  if (!row->mapped) free(row->chars);
   free(row->hl);
 }
 
-void editorDelRow(int16_t at) {
+void editorDelRow(int64_t at) {
   if (at < 0 || at >= config.numrows) return;
-  editorFreeRow(&config.row[at]);
-  memmove(&config.row[at], &config.row[at + 1],
-          sizeof(erow) * (config.numrows - at - 1));
+  searchInvalidate();
+  editorFreeRow(editorRowAt(at));
+  rowStoreRemove(at);
+  config.hlvalid = MIN(config.hlvalid, at);
+  // the rows below move up, so the file changes from here on
+  if (at < config.numrows - 1) editorRowAt(at)->modified = 1;
   config.dirty++;
   if (--config.numrows <= 0)
     editorInsertRow(at, "", 0);
 }
 
-void editorRowInsertChar(erow *row, int16_t at, int16_t c) {
-  if (at < 0 || at > row->size) at = row->size;
-  row->chars = realloc(row->chars, row->size + 2);
-  memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-  row->size++;
-  row->chars[at] = c;
-  editorUpdateRow(row);
+// swap in new contents for row y, taking ownership of chars
+void editorRowReplace(erow *row, int64_t y, char *chars, int64_t len) {
+  searchInvalidate();
+  editorSyntaxInvalidate(row, y);
+  if (!row->mapped) free(row->chars);
+  row->chars = chars;
+  row->size = len;
+  row->mapped = 0;
+  row->modified = 1;
+  if (row->render) editorUpdateRow(row);
   config.dirty++;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
+void editorRowInsertString(erow *row, int64_t y, int64_t at, char *s,
+                           size_t len) {
+  if (at < 0 || at > row->size) at = row->size;
+  editorRowOwn(row, y);
   row->chars = realloc(row->chars, row->size + len + 1);
-  memcpy(&row->chars[row->size], s, len);
+  memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+  memcpy(&row->chars[at], s, len);
   row->size += len;
-  row->chars[row->size] = '\0';
-  editorUpdateRow(row);
+  row->tabs += countTabs(s, len);
+  editorUpdateRowSpan(row, at, len, 0);
   config.dirty++;
 }
 
-void editorRowDelChar(erow *row, int16_t at) {
-  if (at < 0 || at > row->size) return;
-  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-  row->size--;
-  editorUpdateRow(row);
+void editorRowInsertChar(erow *row, int64_t y, int64_t at, int16_t c) {
+  char ch = c;
+  editorRowInsertString(row, y, at, &ch, 1);
+}
+
+void editorRowTruncate(erow *row, int64_t y, int64_t at) {
+  if (at < 0 || at >= row->size) return;
+  editorRowOwn(row, y);
+  int64_t cut = row->size - at;
+  row->tabs -= countTabs(&row->chars[at], cut);
+  row->size = at;
+  row->chars[at] = '\0';
+  editorUpdateRowSpan(row, at, 0, cut);
+  config.dirty++;
+}
+
+void editorRowAppendString(erow *row, int64_t y, char *s, size_t len) {
+  editorRowOwn(row, y);
+  row->chars = realloc(row->chars, row->size + len + 1);
+  memcpy(&row->chars[row->size], s, len);
+  row->size += len;
+  row->chars[row->size] = '\0';
+  row->tabs += countTabs(s, len);
+  editorUpdateRowSpan(row, row->size - len, len, 0);
+  config.dirty++;
+}
+
+void editorRowDelChar(erow *row, int64_t y, int64_t at) {
+  if (at < 0 || at >= row->size) return;
+  editorRowOwn(row, y);
+  if (row->chars[at] == '\t') row->tabs--;
+  memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
+  row->size--;
+  editorUpdateRowSpan(row, at, 0, 1);
   config.dirty++;
 }
 
@@ -470,11 +1698,15 @@ void editorInsertChar(int16_t c) {
   if (config.cy == config.numrows) {
     editorInsertRow(config.numrows, "", 0);
   }
-  editorRowInsertChar(&config.row[config.cy], config.cx++, c);
+  char ch = c;
+  // the row inserts past its end at the end, log it where it lands
+  config.cx = MIN(config.cx, editorRowAt(config.cy)->size);
+  undoRecord(UNDO_INSERT, config.cy, config.cx, &ch, 1);
+  editorRowInsertChar(editorRowAt(config.cy), config.cy, config.cx++, c);
 }
 
-void editorInsertString(char* str, int16_t len) {
-  for (int16_t i = 0; i < len; i++){
+void editorInsertString(char* str, size_t len) {
+  for (size_t i = 0; i < len; i++){
     editorInsertChar(str[i]);
   }
 }
@@ -484,183 +1716,2705 @@ int8_t editorDelChar() {
   if (config.cy == config.numrows) return 0;
   if (config.cx <= 0 && config.cy == 0) return 0;
 
-  int8_t deleted = config.row[config.cy].chars[config.cx - 1];
+  int8_t deleted = config.cx > 0 ? editorRowAt(config.cy)->chars[config.cx - 1]
+                                 : '\n';
 
-  erow *row = &config.row[config.cy];
+  erow *row = editorRowAt(config.cy);
   if (config.cx > 0){ 
-    editorRowDelChar(row, config.cx-- - 1);
+    if (config.cx <= row->size)
+      undoRecord(UNDO_DELETE, config.cy, config.cx - 1,
+                 &row->chars[config.cx - 1], 1);
+    editorRowDelChar(row, config.cy, config.cx-- - 1);
   } else {
-    config.cx = config.row[config.cy - 1].size;
-    editorRowAppendString(&config.row[config.cy - 1], row->chars, row->size);
+    config.cx = editorRowAt(config.cy - 1)->size;
+    undoRecord(UNDO_DELETE, config.cy - 1, config.cx, "\n", 1);
+    editorRowAppendString(editorRowAt(config.cy - 1), config.cy - 1,
+                          row->chars, row->size);
     editorDelRow(config.cy--);
   }
   return deleted;
 }
 
 void editorInsertNewLine() {
+  config.cx = MIN(config.cx, editorRowAt(config.cy)->size);
+  undoRecord(UNDO_INSERT, config.cy, config.cx, "\n", 1);
   if (config.cx == 0) {
     editorInsertRow(config.cy, "", 0);
   } else {
-    erow *row = &config.row[config.cy];
+    erow *row = editorRowAt(config.cy);
     editorInsertRow(config.cy + 1, &row->chars[config.cx], 
                     row->size - config.cx);
-    row = &config.row[config.cy];
-    row->size = config.cx;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    editorRowTruncate(editorRowAt(config.cy), config.cy, config.cx);
   }
   config.cy++;
   config.cx = 0;
 }
 
+size_t findLineBreak(char *s, size_t len) {
+  char *nl = memchr(s, '\n', len);
+  return nl ? (size_t) (nl - s) : len;
+}
+
+/*
+ * insert text at the cursor as typed, without any of the per key
+ * handling. the current row is split once and every complete line in
+ * between goes into the row store as one batch.
+ */
+void editorInsertText(char *s, size_t len) {
+  erow *row = editorRowAt(config.cy);
+  config.cx = MIN(config.cx, row->size);    // the row is split at cx
+  undoRecord(UNDO_INSERT, config.cy, config.cx, s, len);
+  size_t linelen = findLineBreak(s, len);
+
+  if (linelen == len) {
+    editorRowInsertString(row, config.cy, config.cx, s, len);
+    config.cx += len;
+    return;
+  }
+
+  size_t taillen = row->size - config.cx;
+  char *tail = malloc(taillen);
+  memcpy(tail, &row->chars[config.cx], taillen);
+  editorRowTruncate(row, config.cy, config.cx);
+  editorRowAppendString(row, config.cy, s, linelen);
+
+  erow *batch = rowbatch;
+  int64_t n = 0;
+  int64_t at = config.cy + 1;
+
+  while (linelen < len) {
+    s += linelen + 1;
+    len -= linelen + 1;
+    linelen = findLineBreak(s, len);
+
+    bool last = linelen == len;
+    size_t size = last ? linelen + taillen : linelen;
+    char *chars = malloc(size + 1);
+    memcpy(chars, s, linelen);
+    if (last) memcpy(&chars[linelen], tail, taillen);
+    chars[size] = '\0';
+    editorInitRow(&batch[n++], chars, size, 0);
+
+    if (n == ROW_BATCH || last) {
+      editorInsertRows(at, batch, n);
+      at += n;
+      n = 0;
+    }
+  }
+
+  free(tail);
+  config.cy = at - 1;
+  config.cx = linelen;
+}
+
+// delete from column x of row y up to column ex of row ey
+void editorDeleteSpan(int64_t y, int64_t x, int64_t ey, int64_t ex) {
+  erow *first = editorRowAt(y), *last = editorRowAt(ey);
+  if (first == NULL || last == NULL || x > first->size || ex > last->size)
+    return;
+  int64_t taillen = last->size - ex;
+  char *chars = malloc(x + taillen + 1);
+  memcpy(chars, first->chars, x);
+  memcpy(&chars[x], &last->chars[ex], taillen);
+  chars[x + taillen] = '\0';
+  editorRowReplace(first, y, chars, x + taillen);
+  for (int64_t i = y; i < ey; i++) editorDelRow(y + 1);
+}
+
+// editorDeleteSpan, logging the deleted text like any other edit
+void editorDeleteRange(int64_t y, int64_t x, int64_t ey, int64_t ex) {
+  struct abuf ab = ABUF_INIT;
+  for (int64_t i = y; i <= ey; i++) {
+    erow *row = editorRowAt(i);
+    int64_t from = i == y ? x : 0;
+    int64_t to = i == ey ? ex : row->size;
+    if (to > from) abAppend(&ab, &row->chars[from], to - from);
+    if (i < ey) abAppend(&ab, "\n", 1);
+  }
+  undoRecord(UNDO_DELETE, y, x, ab.buf, ab.len);
+  editorDeleteSpan(y, x, ey, ex);
+  abFree(&ab);
+}
+
+// delete the cursor row along with one of its line breaks
+void editorDelLine() {
+  int64_t y = config.cy;
+  erow *row = editorRowAt(y);
+  char *text = malloc(row->size + 1);
+  int64_t len = row->size + (config.numrows > 1);
+
+  if (y + 1 < config.numrows) {
+    memcpy(text, row->chars, row->size);
+    text[row->size] = '\n';
+    undoRecord(UNDO_DELETE, y, 0, text, len);
+    editorDeleteSpan(y, 0, y + 1, 0);
+  } else if (y > 0) {
+    int64_t x = editorRowAt(y - 1)->size;
+    text[0] = '\n';
+    memcpy(&text[1], row->chars, row->size);
+    undoRecord(UNDO_DELETE, y - 1, x, text, len);
+    editorDeleteSpan(y - 1, x, y, row->size);
+  } else {
+    memcpy(text, row->chars, row->size);
+    undoRecord(UNDO_DELETE, 0, 0, text, len);
+    editorDeleteSpan(0, 0, 0, row->size);
+  }
+  free(text);
+}
+
+void editorPaste() {
+  size_t len, n = 0;
+  char *paste = editorReadPaste(&len);
+  // terminals send "\r" for newlines, "\r\n" or a lone "\r" is one "\n"
+  for (size_t i = 0; i < len; i++) {
+    if (paste[i] != '\r') paste[n++] = paste[i];
+    else if (i + 1 == len || paste[i + 1] != '\n') paste[n++] = '\n';
+  }
+  editorInsertText(paste, n);
+  free(paste);
+}
+
+/*** undo ***/
+
+/*
+ * every edit is logged as text inserted or deleted at a row and column,
+ * line breaks included. records are packed into one arena, oldest
+ * first: a type byte, varints for step, row, column and length, the
+ * text, and the record size in 4 bytes so the log can be walked back.
+ * records sharing a step are undone and redone together, each key
+ * starts a new step unless it is typing that carries on where the last
+ * key left the cursor. typing next to the last record of the step is
+ * merged into it, so a burst of typing costs one record.
+ *
+ * pos splits the log into done records and undone ones, which a new
+ * edit throws away. past config.undo.limit the oldest steps go.
+ */
+
+char *putVarint(char *p, uint64_t v) {
+  while (v >= 128) {
+    *p++ = (v & 127) | 128;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+uint64_t getVarint(char **p) {
+  uint64_t v = 0;
+  uint8_t b;
+  int16_t shift = 0;
+  do {
+    b = *(*p)++;
+    v |= (uint64_t) (b & 127) << shift;
+    shift += 7;
+  } while (b & 128);
+  return v;
+}
+
+void undoDecode(size_t off, undorec *r) {
+  char *p = &config.undo.buf[off];
+  r->type = *p++;
+  r->step = getVarint(&p);
+  r->y = getVarint(&p);
+  r->x = getVarint(&p);
+  r->len = getVarint(&p);
+  r->text = p;
+  r->size = p - &config.undo.buf[off] + r->len + 4;
+}
+
+// offset of the record that ends at end
+size_t undoPrev(size_t end) {
+  uint32_t size;
+  memcpy(&size, &config.undo.buf[end - 4], 4);
+  return end - size;
+}
+
+// where text inserted at y, x ends
+void undoSpanEnd(undorec *r, int64_t *ey, int64_t *ex) {
+  char *p = r->text, *end = r->text + r->len, *nl;
+  *ey = r->y;
+  *ex = r->x;
+  while ((nl = memchr(p, '\n', end - p)) != NULL) {
+    (*ey)++;
+    *ex = 0;
+    p = nl + 1;
+  }
+  *ex += end - p;
+}
+
+void undoClear() {
+  struct undolog *u = &config.undo;
+  free(u->buf);
+  u->buf = NULL;
+  u->len = u->cap = u->pos = 0;
+}
+
+// the open step is lost, record nothing more of it
+void undoOverflow() {
+  undoClear();
+  config.undo.overflow = 1;
+  editorSetStatusMessage("change too large to undo");
+}
+
+void undoAppend(undorec *r, const char *text) {
+  struct undolog *u = &config.undo;
+  char head[48], *p = head;
+  *p++ = r->type;
+  p = putVarint(p, r->step);
+  p = putVarint(p, r->y);
+  p = putVarint(p, r->x);
+  p = putVarint(p, r->len);
+  size_t hlen = p - head, size = hlen + r->len + 4;
+
+  if (size > UINT32_MAX || size > u->limit) {
+    undoOverflow();
+    return;
+  }
+  if (u->len + size > u->cap) {
+    size_t cap = u->cap ? u->cap : 4096;
+    while (cap < u->len + size) cap *= 2;
+    char *buf = realloc(u->buf, cap);
+    if (buf == NULL) {
+      undoOverflow();
+      return;
+    }
+    u->buf = buf;
+    u->cap = cap;
+  }
+
+  uint32_t size32 = size;
+  memcpy(&u->buf[u->len], head, hlen);
+  memcpy(&u->buf[u->len + hlen], text, r->len);
+  memcpy(&u->buf[u->len + hlen + r->len], &size32, 4);
+  u->len += size;
+  u->pos = u->len;
+}
+
+/*
+ * drop whole steps from the front until the log is down to three
+ * quarters of the limit, so the memmove is paid once in a while rather
+ * than on every key. the open step is never split.
+ */
+void undoTrim() {
+  struct undolog *u = &config.undo;
+  if (u->len <= u->limit) return;
+
+  size_t off = 0;
+  uint64_t dropped = 0;
+  undorec r;
+  while (off < u->len) {
+    undoDecode(off, &r);
+    if (r.step == u->step) break;
+    if (off > 0 && r.step != dropped && u->len - off <= u->limit / 4 * 3)
+      break;
+    dropped = r.step;
+    off += r.size;
+  }
+  if (u->len - off > u->limit) {
+    undoOverflow();
+    return;
+  }
+  memmove(u->buf, &u->buf[off], u->len - off);
+  u->len -= off;
+  u->pos = u->len;
+}
+
+void undoRecord(int8_t type, int64_t y, int64_t x, const char *text,
+                int64_t len) {
+  struct undolog *u = &config.undo;
+  if (u->replaying || len == 0) return;
+  swapRecord(type, y, x, text, len);
+  if (u->overflow) return;
+  u->len = u->pos;
+
+  undorec r = {type, 0, y, x, len, NULL, 0};
+  if (u->open && u->pos > 0) {
+    undorec last;
+    size_t off = undoPrev(u->pos);
+    undoDecode(off, &last);
+
+    int64_t ly, lx, ey, ex;
+    undoSpanEnd(&last, &ly, &lx);
+    r.text = (char *) text;
+    undoSpanEnd(&r, &ey, &ex);
+
+    bool append = last.type == type && (type == UNDO_INSERT
+      ? y == ly && x == lx                  // typed after it
+      : y == last.y && x == last.x);        // deleted forward
+    bool prepend = last.type == type && type == UNDO_DELETE
+      && ey == last.y && ex == last.x;      // deleted backward
+
+    if (append || prepend) {
+      char *merged = malloc(last.len + len);
+      if (append) {
+        memcpy(merged, last.text, last.len);
+        memcpy(&merged[last.len], text, len);
+        r.y = last.y;
+        r.x = last.x;
+      } else {
+        memcpy(merged, text, len);
+        memcpy(&merged[len], last.text, last.len);
+      }
+      r.len += last.len;
+      r.step = last.step;
+      u->len = off;
+      undoAppend(&r, merged);
+      free(merged);
+      undoTrim();
+      return;
+    }
+  }
+
+  if (!u->open) u->step++;
+  u->open = 1;
+  r.step = u->step;
+  undoAppend(&r, text);
+  undoTrim();
+}
+
+void undoBreak() {
+  config.undo.open = 0;
+  config.undo.overflow = 0;
+}
+
+// before each key: anything but more typing right where the last key
+// left the cursor ends the step
+void undoKey(int16_t c) {
+  struct undolog *u = &config.undo;
+  bool typing = c == '\r' || c == BACKSPACE || c == CTRL_KEY('h')
+    || c == KEY_DEL || (c >= ' ' && c < BACKSPACE) || c < 0;
+  if (config.mode != MODE_INSERT || !typing
+      || config.cx != u->cx || config.cy != u->cy)
+    undoBreak();
+}
+
+void editorInsertAt(int64_t y, int64_t x, char *text, int64_t len) {
+  config.cy = y;
+  config.cx = x;
+  editorInsertText(text, len);
+}
+
+void editorUndo() {
+  struct undolog *u = &config.undo;
+  if (u->pos == 0) {
+    editorSetStatusMessage("already at oldest change");
+    return;
+  }
+  undoBreak();
+  u->replaying = 1;
+
+  undorec r;
+  undoDecode(undoPrev(u->pos), &r);
+  uint64_t step = r.step;
+  while (u->pos > 0) {
+    undoDecode(undoPrev(u->pos), &r);
+    if (r.step != step) break;
+    int64_t ey, ex;
+    undoSpanEnd(&r, &ey, &ex);
+    swapRecord(r.type == UNDO_INSERT ? UNDO_DELETE : UNDO_INSERT,
+               r.y, r.x, r.text, r.len);
+    if (r.type == UNDO_INSERT) editorDeleteSpan(r.y, r.x, ey, ex);
+    else editorInsertAt(r.y, r.x, r.text, r.len);
+    config.cy = r.y;
+    config.cx = r.x;
+    u->pos -= r.size;
+  }
+  u->replaying = 0;
+}
+
+void editorRedo() {
+  struct undolog *u = &config.undo;
+  if (u->pos == u->len) {
+    editorSetStatusMessage("already at newest change");
+    return;
+  }
+  undoBreak();
+  u->replaying = 1;
+
+  undorec r;
+  undoDecode(u->pos, &r);
+  uint64_t step = r.step;
+  while (u->pos < u->len) {
+    undoDecode(u->pos, &r);
+    if (r.step != step) break;
+    swapRecord(r.type, r.y, r.x, r.text, r.len);
+    if (r.type == UNDO_INSERT) {
+      editorInsertAt(r.y, r.x, r.text, r.len);
+    } else {
+      int64_t ey, ex;
+      undoSpanEnd(&r, &ey, &ex);
+      editorDeleteSpan(r.y, r.x, ey, ex);
+      config.cy = r.y;
+      config.cx = r.x;
+    }
+    u->pos += r.size;
+  }
+  u->replaying = 0;
+}
+
+/*** swap file ***/
+
+/*
+ * edits to a named file are logged next to it in .<name>.swp, so they
+ * survive the editor dying before a save. the file holds a header (the
+ * magic, the pid of the editor writing it and the size and mtime of the
+ * file the edits apply to) and then one record per edit in the order
+ * they were made: a type byte, varints for row and column, and either
+ * the length and text of an insert or the end row and column of a
+ * delete. records only go to memory while typing, the event loop hands
+ * them to a writer thread SWAP_INTERVAL ms after the first one so the
+ * disk never holds up a key. a save starts the log over, a clean quit
+ * removes it.
+ */
+
+// make room for len more bytes, the caller holds config.swap.lock
+void swapReserve(size_t len) {
+  struct swap *w = &config.swap;
+  if (w->len + len > w->cap) {
+    size_t cap = w->cap ? w->cap : 4096;
+    while (cap < w->len + len) cap *= 2;
+    w->buf = realloc(w->buf, cap);
+    if (w->buf == NULL) die("realloc");
+    w->cap = cap;
+  }
+}
+
+// the caller holds config.swap.lock
+void swapAppend(const char *p, size_t len) {
+  struct swap *w = &config.swap;
+  swapReserve(len);
+  memcpy(&w->buf[w->len], p, len);
+  w->len += len;
+}
+
+void swapRecord(int8_t type, int64_t y, int64_t x, const char *text,
+                int64_t len) {
+  struct swap *w = &config.swap;
+  if (w->path == NULL) return;
+
+  char head[48], *p = head;
+  *p++ = type;
+  p = putVarint(p, y);
+  p = putVarint(p, x);
+  if (type == UNDO_INSERT) {
+    p = putVarint(p, len);
+  } else {
+    undorec r = {type, 0, y, x, len, (char *) text, 0};
+    int64_t ey, ex;
+    undoSpanEnd(&r, &ey, &ex);
+    p = putVarint(p, ey);
+    p = putVarint(p, ex);
+  }
+
+  undorec r = {type, 0, y, x, len, (char *) text, 0};
+  pthread_mutex_lock(&w->lock);
+  if (type == UNDO_INSERT && w->last != -1 && y == w->ly && x == w->lx) {
+    // typing on from the last insert still in memory, grow its text
+    char *q = &w->buf[w->last + 1];
+    int64_t ty = getVarint(&q);
+    int64_t tx = getVarint(&q);
+    int64_t tlen = getVarint(&q);
+    size_t toff = q - w->buf;
+    char merged[48];
+    p = putVarint(putVarint(putVarint(merged, ty), tx), tlen + len);
+    size_t hlen = 1 + (p - merged);
+    // the length may take a byte more than before, on top of the text
+    swapReserve(len + hlen - (toff - w->last));
+    memmove(&w->buf[w->last + hlen], &w->buf[toff], tlen);
+    memcpy(&w->buf[w->last + 1], merged, hlen - 1);
+    memcpy(&w->buf[w->last + hlen + tlen], text, len);
+    w->len = w->last + hlen + tlen + len;
+  } else {
+    w->last = type == UNDO_INSERT ? (int64_t) w->len : -1;
+    swapAppend(head, p - head);
+    if (type == UNDO_INSERT) swapAppend(text, len);
+  }
+  if (type == UNDO_INSERT) undoSpanEnd(&r, &w->ly, &w->lx);
+  pthread_mutex_unlock(&w->lock);
+  if (w->due == 0) w->due = nowMillis() + SWAP_INTERVAL;
+}
+
+void *swapWriter(void *arg) {
+  struct swap *w = &config.swap;
+  (void) arg;
+
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    while (!w->flush) pthread_cond_wait(&w->work, &w->lock);
+    // take the pending records and leave the spare buffer in their place
+    struct iovec iov = {w->buf, w->len};
+    size_t cap = w->cap;
+    bool reset = w->reset;
+    w->buf = w->spare;
+    w->cap = w->sparecap;
+    w->len = 0;
+    w->last = -1;
+    w->flush = w->reset = 0;
+    pthread_mutex_unlock(&w->lock);
+
+    int err = 0;
+    if (reset && ftruncate(w->fd, 0) == -1) err = errno;
+    if (!err && writevAll(w->fd, &iov, 1) == -1) err = errno;
+    if (!err && fdatasync(w->fd) == -1) err = errno;
+
+    pthread_mutex_lock(&w->lock);
+    w->spare = iov.iov_base;
+    w->sparecap = cap;
+    if (err) w->err = err;
+  }
+  return NULL;
+}
+
+void swapSignal() {
+  struct swap *w = &config.swap;
+  w->flush = 1;
+  w->due = 0;
+  pthread_cond_signal(&w->work);
+}
+
+// from the event loop: hand the pending records over once they are due
+void swapTick() {
+  struct swap *w = &config.swap;
+  if (w->path == NULL) return;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->due && nowMillis() >= w->due) swapSignal();
+  int err = w->err;
+  w->err = 0;
+  pthread_mutex_unlock(&w->lock);
+
+  if (err) editorSetStatusMessage("Can't write swap file: %s", strerror(err));
+}
+
+// start the log over against the file as it is on disk now
+void swapReset() {
+  struct swap *w = &config.swap;
+  if (w->path == NULL) return;
+
+  char head[64], *p = head;
+  memcpy(p, SWAP_MAGIC, 8);
+  p = putVarint(p + 8, getpid());
+  p = putVarint(p, config.disk.st_size);
+  p = putVarint(p, config.disk.st_mtim.tv_sec);
+  p = putVarint(p, config.disk.st_mtim.tv_nsec);
+
+  pthread_mutex_lock(&w->lock);
+  w->len = 0;
+  w->last = -1;
+  w->reset = 1;
+  swapAppend(head, p - head);
+  swapSignal();
+  pthread_mutex_unlock(&w->lock);
+}
+
+// a clean quit leaves nothing to recover
+void swapRemove() {
+  if (config.swap.path) unlink(config.swap.path);
+}
+
+// getVarint for data read back from disk, which may end mid record
+bool swapVarint(char **p, char *end, uint64_t *v) {
+  *v = 0;
+  for (int16_t shift = 0; *p < end && shift < 64; shift += 7) {
+    uint8_t b = *(*p)++;
+    *v |= (uint64_t) (b & 127) << shift;
+    if (!(b & 128)) return 1;
+  }
+  return 0;
+}
+
+/*
+ * apply the records of an old swap file, stopping at one that is torn
+ * or doesn't fit the buffer. the edits are logged again as they go, so
+ * they land in the new swap file and undo as one step. returns how
+ * many were applied.
+ */
+int64_t swapReplay(char *p, char *end) {
+  int64_t n = 0;
+  undoBreak();
+  while (p < end) {
+    int8_t type = *p++;
+    uint64_t y, x, a, b;
+    if (!swapVarint(&p, end, &y) || !swapVarint(&p, end, &x) ||
+        !swapVarint(&p, end, &a))
+      break;
+    if (y >= (uint64_t) config.numrows ||
+        x > (uint64_t) editorRowAt(y)->size)
+      break;
+
+    if (type == UNDO_INSERT) {
+      if (a > (uint64_t) (end - p)) break;
+      editorInsertAt(y, x, p, a);
+      p += a;
+    } else if (type == UNDO_DELETE) {
+      if (!swapVarint(&p, end, &b) || a < y ||
+          a >= (uint64_t) config.numrows ||
+          b > (uint64_t) editorRowAt(a)->size || (a == y && b < x))
+        break;
+      editorDeleteRange(y, x, a, b);
+      config.cy = y;
+      config.cx = x;
+    } else {
+      break;
+    }
+    n++;
+  }
+  undoBreak();
+  return n;
+}
+
+char *swapPath(const char *filename) {
+  const char *slash = strrchr(filename, '/');
+  int dirlen = slash ? slash - filename + 1 : 0;
+  const char *base = slash ? slash + 1 : filename;
+  size_t size = dirlen + strlen(base) + 7;
+  char *path = malloc(size);
+  snprintf(path, size, "%.*s.%s.swp", dirlen, filename, base);
+  return path;
+}
+
+// read all of a small file, NULL if there is none
+char *swapReadFile(const char *path, size_t *len) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return NULL;
+
+  struct stat st;
+  char *buf = NULL;
+  *len = 0;
+  if (fstat(fd, &st) == 0 && (buf = malloc(st.st_size + 1)) != NULL) {
+    ssize_t n;
+    while (*len < (size_t) st.st_size &&
+           (n = read(fd, &buf[*len], st.st_size - *len)) != 0) {
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        break;
+      }
+      *len += n;
+    }
+  }
+  close(fd);
+  return buf;
+}
+
+/*
+ * begin logging edits to config.filename. a swap file left by an editor
+ * that is still running is left alone, and edits aren't logged. one left
+ * by an editor that died is offered for replay when recover is set and
+ * it was logged against the file as it is now, otherwise it's replaced.
+ */
+void swapStart(bool recover) {
+  struct swap *w = &config.swap;
+  if (w->path || config.disk.st_ino == 0 || config.follow.on) return;
+
+  char *path = swapPath(config.filename);
+  size_t len;
+  char *old = swapReadFile(path, &len);
+  char *p = old, *end = old + len;
+  uint64_t pid, size, sec, nsec;
+
+  if (old && len > 8 && memcmp(old, SWAP_MAGIC, 8) == 0) {
+    p += 8;
+    bool valid = swapVarint(&p, end, &pid) && swapVarint(&p, end, &size) &&
+      swapVarint(&p, end, &sec) && swapVarint(&p, end, &nsec);
+    if (valid && pid != (uint64_t) getpid() &&
+        (kill(pid, 0) == 0 || errno == EPERM)) {
+      editorSetStatusMessage("%s is being edited by process %" PRIu64
+                             ", not keeping a swap file", config.filename, pid);
+      free(old);
+      free(path);
+      return;
+    }
+    recover = recover && valid && p < end;
+    if (recover && (size != (uint64_t) config.disk.st_size ||
+        sec != (uint64_t) config.disk.st_mtim.tv_sec ||
+        nsec != (uint64_t) config.disk.st_mtim.tv_nsec)) {
+      editorSetStatusMessage("Swap file is for an older version of the file, "
+                             "discarded");
+      recover = 0;
+    }
+  } else {
+    recover = 0;
+  }
+
+  if (recover) {
+    char *answer = editorPrompt("Unsaved changes found in the swap file, "
+                                "recover them? (y/n) %s", 1, NULL);
+    recover = answer && (answer[0] == 'y' || answer[0] == 'Y');
+    free(answer);
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                0600);
+  if (fd == -1) {
+    editorSetStatusMessage("Can't write swap file: %s", strerror(errno));
+    free(old);
+    free(path);
+    return;
+  }
+
+  if (!w->started) {
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    if (pthread_create(&w->thread, NULL, swapWriter, NULL) != 0)
+      die("pthread_create");
+    w->started = 1;
+  }
+  w->fd = fd;
+  w->path = path;
+  swapReset();
+
+  if (recover) {
+    editorLoadAll();    // the records may be for any row
+    int64_t n = swapReplay(p, end);
+    config.cy = MIN(config.cy, config.numrows - 1);
+    editorSetStatusMessage("Recovered %" PRId64 " changes from the swap file",
+                           n);
+  }
+  free(old);
+}
+
 /*** file i/o ***/
 
-char *editorRowsToString(int16_t *buflen){
-  int16_t totlen = 0;
-  for (int16_t i = 0; i < config.numrows; i++)
-    totlen += config.row[i].size + 1;
-  *buflen = totlen;
-
-  char *buf = malloc(totlen);
-  char *p = buf;
-  for (int16_t i = 0; i < config.numrows; i++){
-    memcpy(p, config.row[i].chars, config.row[i].size);
-    p += config.row[i].size;
-    *p = '\n';
-    p++;
+/*
+ * index the mapping into rows from config.loaded on, up to the line that
+ * holds byte upto. the rows are appended, and edits never move the rows
+ * above them, so the user can work on the top of a big file while the
+ * event loop indexes the rest LOAD_STEP bytes at a time. anything that
+ * needs every row (saving, the end of the file, :%s) calls editorLoadAll.
+ */
+void editorLoadRows(size_t upto) {
+  if (config.map == NULL || config.loaded >= config.maplen) return;
+  char *p = config.map + config.loaded;
+  char *end = config.map + config.maplen;
+  char *stop = upto < config.maplen ? config.map + upto : end;
+  uint64_t dirty = config.dirty;    // these rows are the file as it is
+
+  erow *batch = rowbatch;
+  int64_t n = 0;
+
+  while (p < stop) {
+    char *nl = memchr(p, '\n', end - p);
+    char *eol = nl ? nl : end;
+    char *next = nl ? nl + 1 : end;
+    while (eol > p && eol[-1] == '\r') eol--;
+
+    editorInitRow(&batch[n], p, eol - p, 1);
+    // saving writes a plain '\n' after every row, so a row without one
+    // on disk has to be rewritten
+    batch[n++].modified = eol != nl;
+    if (n == ROW_BATCH) {
+      editorInsertRows(config.numrows, batch, n);
+      n = 0;
+    }
+    p = next;
+  }
+  editorInsertRows(config.numrows, batch, n);
+
+  config.loaded = p - config.map;
+  config.dirty = dirty;
+}
+
+void editorLoadAll() {
+  editorLoadRows(config.maplen);
+}
+
+// index on until row y has one after it, or the file has no more
+void editorLoadBelow(int64_t y) {
+  while (config.loaded < config.maplen && y + 1 >= config.numrows)
+    editorLoadRows(config.loaded + LOAD_STEP);
+}
+
+/*
+ * map the file read-only and point rows straight into the mapping, rows
+ * are copied to the heap only once they are edited (editorRowOwn) and
+ * rendered only once they are drawn (editorRowPrepare). only the first
+ * LOAD_STEP bytes are indexed here, so opening takes the same time
+ * whatever the size of the file.
+ */
+int8_t editorOpenMapped(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    return -1;
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) return -1;
+
+  config.map = map;
+  config.maplen = st.st_size;
+  config.loaded = 0;
+  config.mapdisk = 1;
+  editorLoadRows(LOAD_STEP);
+  return 0;
+}
+
+// not mappable (pipes, character devices, empty files), read it instead
+void editorOpenStream(int fd) {
+  FILE *fp = fdopen(fd, "r");
+  if (fp == NULL) die("fdopen");
+
+  char *line = NULL;
+  size_t linecap = 0;
+  ssize_t linelen;
+
+  erow *batch = rowbatch;
+  int64_t n = 0;
+
+  while ((linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen > 0 && (line[linelen - 1] == '\n' ||
+      line[linelen - 1] == '\r'))
+      linelen--;
+
+    char *chars = malloc(linelen + 1);
+    memcpy(chars, line, linelen);
+    chars[linelen] = '\0';
+    editorInitRow(&batch[n++], chars, linelen, 0);
+    if (n == ROW_BATCH) {
+      editorInsertRows(config.numrows, batch, n);
+      n = 0;
+    }
+  }
+  editorInsertRows(config.numrows, batch, n);
+
+  free(line);
+  fclose(fp);
+}
+
+void editorOpen(char *filename) {
+  free(config.filename);
+  config.filename = strdup(filename); 
+
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) die("open");
+  if (fstat(fd, &config.disk) == -1 || !S_ISREG(config.disk.st_mode))
+    config.disk.st_ino = 0;
+
+  if (editorOpenMapped(fd) == 0)
+    close(fd);
+  else
+    editorOpenStream(fd);
+
+  // the rest of the editor expects at least one row to put the cursor on
+  if (config.numrows == 0) editorInsertRow(0, "", 0);
+  editorSelectSyntax();
+
+  config.dirty = 0;
+  swapStart(1);
+
+}
+
+// write every iovec, carrying on after short writes (linux caps a
+// single call just under 2GB) and signals
+int8_t writevAll(int fd, struct iovec *iov, int n) {
+  while (n > 0) {
+    ssize_t w = writev(fd, iov, n);
+    if (w == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    while (n > 0 && (size_t) w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if (n > 0) {
+      iov->iov_base = (char *) iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 0;
+}
+
+// queue len bytes at p, growing the last iovec when p carries straight
+// on from it, as the rows of an untouched mapped file do
+void iovPush(struct iovec *iov, int *n, const char *p, size_t len) {
+  if (*n > 0) {
+    struct iovec *last = &iov[*n - 1];
+    if ((char *) last->iov_base + last->iov_len == p) {
+      last->iov_len += len;
+      return;
+    }
+  }
+  iov[*n].iov_base = (void *) p;
+  iov[*n].iov_len = len;
+  (*n)++;
+}
+
+/*
+ * write the rows from y on to fd, each followed by a newline, in batches
+ * of iovecs pointing straight at the rows' chars. nothing is copied, so
+ * saving takes the same small amount of memory whatever the file size.
+ * *len is set to the number of bytes written.
+ */
+int8_t editorWriteRows(int fd, int64_t y, size_t *len) {
+  struct iovec iov[WRITE_IOVS];
+  int n = 0;
+  char *mapend = config.map + config.maplen;
+
+  *len = 0;
+  rowiter it;
+  for (erow *row = editorRowIterStart(&it, y); row; row = editorRowIterNext(&it)) {
+    if (n > WRITE_IOVS - 2) {
+      if (writevAll(fd, iov, n) == -1) return -1;
+      n = 0;
+    }
+    char *end = row->chars + row->size;
+    if (row->size > 0) iovPush(iov, &n, row->chars, row->size);
+    // a mapped row is usually followed by its own newline in the mapping
+    if (row->mapped && end < mapend && *end == '\n') iovPush(iov, &n, end, 1);
+    else iovPush(iov, &n, "\n", 1);
+    *len += row->size + 1;
+  }
+  return writevAll(fd, iov, n);
+}
+
+/*
+ * the file saving path replaces, with symlinks resolved. realpath fails
+ * on a link to a file that doesn't exist yet, so links are followed by
+ * hand from there, or the rename would replace the link itself.
+ */
+char *editorSaveTarget(const char *path) {
+  char *target = realpath(path, NULL);
+  if (target != NULL || errno != ENOENT) return target;
+
+  target = strdup(path);
+  for (int16_t hops = 0; hops < 40; hops++) {
+    struct stat st;
+    if (lstat(target, &st) == -1 || !S_ISLNK(st.st_mode))
+      return target;            // a new file, or one open will complain about
+
+    char *link = malloc(st.st_size + 1);
+    ssize_t n = readlink(target, link, st.st_size + 1);
+    if (n == -1 || n > st.st_size) {
+      free(link);
+      free(target);
+      if (n != -1) errno = ENAMETOOLONG;    // the link changed under us
+      return NULL;
+    }
+    link[n] = '\0';
+
+    // a relative link is relative to the directory it sits in
+    char *slash = strrchr(target, '/');
+    if (link[0] != '/' && slash != NULL) {
+      int dirlen = slash - target + 1;
+      char *next = malloc(dirlen + n + 1);
+      memcpy(next, target, dirlen);
+      memcpy(next + dirlen, link, n + 1);
+      free(link);
+      link = next;
+    }
+    free(target);
+    target = link;
+  }
+  free(target);
+  errno = ELOOP;
+  return NULL;
+}
+
+/*
+ * replace path with the rows through a temporary file in the same
+ * directory: write it, fsync it, rename it over the original and fsync
+ * the directory. a crash, full disk or failed write at any point leaves
+ * either the old file or the new one, never a truncated mix. the old
+ * file's mode and owner carry over, and a symlink is followed so the
+ * link stays a link. a file we may not write is refused, as opening it
+ * for writing would be. *len is set to the bytes written and *saved to
+ * the new file. returns -1 with errno set on failure, having removed
+ * the temporary file.
+ */
+int8_t editorWriteAtomic(const char *path, size_t *len, struct stat *saved) {
+  char *target = editorSaveTarget(path);
+  if (target == NULL) return -1;
+
+  struct stat st;
+  bool exists = stat(target, &st) == 0;
+  if (exists && access(target, W_OK) == -1) {
+    free(target);
+    return -1;
+  }
+
+  char *slash = strrchr(target, '/');
+  int dirlen = slash ? slash - target : 0;
+  const char *base = slash ? slash + 1 : target;
+  size_t tmpsize = dirlen + strlen(base) + 16;
+  char *tmp = malloc(tmpsize);
+  if (slash) snprintf(tmp, tmpsize, "%.*s/.%s.XXXXXX", dirlen, target, base);
+  else snprintf(tmp, tmpsize, ".%s.XXXXXX", base);
+
+  if (!exists) {
+    mode_t mask = umask(0);
+    umask(mask);
+    st.st_mode = 0644 & ~mask;
+  }
+
+  int err = 0;
+  int fd = mkstemp(tmp);
+  if (fd == -1) err = errno;
+  if (!err && editorWriteRows(fd, 0, len) == -1) err = errno;
+  if (!err && fchmod(fd, st.st_mode & 07777) == -1) err = errno;
+  // only root can give a file away, a new owner is best effort
+  if (!err && exists && fchown(fd, st.st_uid, st.st_gid) == -1)
+    (void) !fchown(fd, -1, st.st_gid);
+  if (!err && fsync(fd) == -1) err = errno;
+  if (!err && fstat(fd, saved) == -1) err = errno;
+  if (fd != -1 && close(fd) == -1 && !err) err = errno;
+  if (!err && rename(tmp, target) == -1) err = errno;
+  if (err && fd != -1) unlink(tmp);
+
+  if (!err) {
+    // the rename itself is only durable once the directory is synced
+    if (slash) *slash = '\0';
+    int dir = open(slash ? (dirlen ? target : "/") : ".",
+                   O_RDONLY | O_DIRECTORY);
+    if (dir != -1) {
+      fsync(dir);
+      close(dir);
+    }
+  }
+
+  free(tmp);
+  free(target);
+  errno = err;
+  return err ? -1 : 0;
+}
+
+/*
+ * find the first row changed since the file was last opened or saved.
+ * *keep gets the bytes the rows before it take on disk, which saving
+ * need not touch, and *total those of the whole buffer.
+ */
+int64_t editorSavedPrefix(size_t *keep, size_t *total) {
+  int64_t y = 0;
+  bool clean = 1;
+  *keep = *total = 0;
+  rowiter it;
+  for (erow *row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it)) {
+    clean = clean && !row->modified;
+    if (clean) {
+      *keep += row->size + 1;
+      y++;
+    }
+    *total += row->size + 1;
+  }
+  return y;
+}
+
+// the file at path is still the one last opened or saved
+bool editorDiskUnchanged(const char *path) {
+  struct stat st;
+  return config.disk.st_ino != 0 && stat(path, &st) == 0 &&
+    st.st_dev == config.disk.st_dev && st.st_ino == config.disk.st_ino &&
+    st.st_size == config.disk.st_size &&
+    st.st_mtim.tv_sec == config.disk.st_mtim.tv_sec &&
+    st.st_mtim.tv_nsec == config.disk.st_mtim.tv_nsec;
+}
+
+/*
+ * rewrite the file in place from byte keep on, where row y starts,
+ * leaving what comes before alone. unlike editorWriteAtomic a crash
+ * midway leaves the tail torn, so editorSave only does this when the
+ * part rewritten is smaller than the part kept, and falls back to the
+ * atomic save when there is no room or the write fails midway. a file
+ * that can't be opened for writing isn't saved at all. the need bytes
+ * to write must fit in the free space before the file is touched,
+ * *touched tells whether a failure left it half written. *len is set to
+ * the bytes written and *saved to the file afterwards.
+ */
+int8_t editorWriteTail(const char *path, int64_t y, size_t keep, size_t need,
+                       size_t *len, struct stat *saved, bool *touched) {
+  *touched = 0;
+  int fd = open(path, O_WRONLY);
+  if (fd == -1) return -1;
+
+  // filesystems that copy on write need room even for overwritten blocks
+  struct statvfs vfs;
+  if (fstatvfs(fd, &vfs) == 0 &&
+      (uint64_t) vfs.f_bavail * vfs.f_frsize < need + vfs.f_frsize) {
+    close(fd);
+    errno = ENOSPC;
+    return -1;
+  }
+
+  if (config.mapdisk) {
+    // rows from y on that borrow from the mapping but land somewhere else
+    // would be overwritten before, or after, they are written out
+    searchInvalidate();
+    size_t at = keep;
+    rowiter it;
+    for (erow *row = editorRowIterStart(&it, y); row; row = editorRowIterNext(&it)) {
+      if (row->mapped && (size_t) (row->chars - config.map) != at)
+        editorRowCopy(row);
+      at += row->size + 1;
+    }
+  }
+
+  int err = 0;
+  if (lseek(fd, keep, SEEK_SET) == -1) err = errno;
+  *touched = !err;
+  if (!err && editorWriteRows(fd, y, len) == -1) err = errno;
+  if (!err && *len != need) err = EIO;
+  if (!err && ftruncate(fd, keep + *len) == -1) err = errno;
+  if (!err && fsync(fd) == -1) err = errno;
+  if (!err && fstat(fd, saved) == -1) err = errno;
+  if (close(fd) == -1 && !err) err = errno;
+  errno = err;
+  return err ? -1 : 0;
+}
+
+void editorSave() {
+  editorLoadAll();
+  if (config.filename == NULL){
+    config.filename = editorPrompt("Save as: %s", 128, NULL);
+    if (config.filename == NULL) {
+      editorSetStatusMessage("Save aborted");
+      return;
+    }
+    editorSelectSyntax();
+  }
+
+  size_t keep, total, len;
+  int64_t y = editorSavedPrefix(&keep, &total);
+  bool tail = keep > 0 && total - keep < keep &&
+    editorDiskUnchanged(config.filename);
+
+  struct stat saved;
+  int8_t err = -1;
+  int tailerr = 0;
+  bool touched = 0;
+  if (tail) {
+    err = editorWriteTail(config.filename, y, keep, total - keep, &len,
+                          &saved, &touched);
+    if (err == -1) tailerr = errno;
+  }
+  // only a file there was no room to patch, or that broke off midway, is
+  // written in full instead. one we can't open for writing is left alone
+  if (!tail || (err == -1 && (touched || tailerr == ENOSPC))) {
+    // the new contents go to a new inode, rows borrowing from the mapping
+    // keep pointing at the old one
+    err = editorWriteAtomic(config.filename, &len, &saved);
+    if (err == 0) config.mapdisk = 0;
+    y = 0;
+  }
+
+  if (err == -1 && touched) {
+    editorSetStatusMessage("SAVE FAILED: %s, %s is left incomplete on disk!",
+                           strerror(errno), config.filename);
+    return;
+  }
+  if (err == -1) {
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    return;
+  }
+
+  rowiter it;
+  for (erow *row = editorRowIterStart(&it, y); row; row = editorRowIterNext(&it))
+    row->modified = 0;
+  config.disk = saved;
+  config.dirty = 0;
+  if (config.swap.path) swapReset();
+  else swapStart(0);
+  if (tailerr)
+    editorSetStatusMessage("In-place save failed (%s), %zu bytes rewritten "
+                           "in full", strerror(tailerr), len);
+  else if (tail)
+    editorSetStatusMessage("%zu bytes written to disk, %zu unchanged", len, keep);
+  else
+    editorSetStatusMessage("%zu bytes written to disk", len);
+}
+
+/*** follow ***/
+
+/*
+ * with -f the file is watched with inotify and whatever gets appended
+ * is read from where the last read stopped, like tail -f. a partial
+ * last line is completed in place, whole lines go into the row store
+ * in batches, so nothing before the end is read or highlighted again.
+ * the buffer mirrors the file and can't be edited.
+ */
+
+// the last row carries on with len more bytes at s
+void followExtend(const char *s, size_t len, bool complete) {
+  int64_t y = config.numrows - 1;
+  erow *row = editorRowAt(y);
+  size_t size = row->size + len;
+  char *chars = malloc(size + 1);
+  memcpy(chars, row->chars, row->size);
+  memcpy(&chars[row->size], s, len);
+  while (complete && size > 0 && chars[size - 1] == '\r') size--;
+  chars[size] = '\0';
+
+  editorRowReplace(row, y, chars, size);
+}
+
+/*
+ * the file shrank, so rows borrowing from the mapping may point past its
+ * end, where touching them raises SIGBUS. drop every row and the mapping
+ * and read the file again from the start.
+ */
+void followReload() {
+  struct follow *f = &config.follow;
+  searchInvalidate();
+  rowiter it;
+  for (erow *row = editorRowIterStart(&it, 0); row; row = editorRowIterNext(&it))
+    editorFreeRow(row);
+  rowFreeNode(config.rows);
+  config.rows = rowNewNode(1);
+  config.numrows = 0;
+  config.hlvalid = 0;
+
+  if (config.map) munmap(config.map, config.maplen);
+  config.map = NULL;
+  config.maplen = config.loaded = 0;
+  config.mapdisk = 0;
+
+  editorInsertRow(0, "", 0);
+  config.cy = config.cx = 0;
+  config.rowoff = config.coloff = 0;
+  f->off = 0;
+  f->partial = 1;
+}
+
+// read what was appended since the last call, up to FOLLOW_BURST reads
+void followRead() {
+  struct follow *f = &config.follow;
+  struct stat st;
+  if (fstat(f->fd, &st) == 0 && st.st_size < f->off) {
+    editorSetStatusMessage("%s: file truncated", config.filename);
+    followReload();
+  }
+
+  bool atend = config.cy >= config.numrows - 1;
+  char buf[FOLLOW_READ];
+  erow *batch = rowbatch;
+  int16_t reads = 0;
+  ssize_t got = 0;
+
+  f->more = 0;
+  while (reads++ < FOLLOW_BURST &&
+         (got = pread(f->fd, buf, sizeof(buf), f->off)) != 0) {
+    if (got == -1) {
+      if (errno == EINTR) continue;
+      editorSetStatusMessage("Can't follow %s: %s", config.filename,
+                             strerror(errno));
+      break;
+    }
+    f->off += got;
+
+    char *p = buf, *end = buf + got;
+    int64_t n = 0;
+    while (p < end) {
+      char *nl = memchr(p, '\n', end - p);
+      char *eol = nl ? nl : end;
+      if (f->partial) {
+        followExtend(p, eol - p, nl != NULL);
+      } else {
+        char *e = eol;
+        while (nl && e > p && e[-1] == '\r') e--;
+        char *chars = malloc(e - p + 1);
+        memcpy(chars, p, e - p);
+        chars[e - p] = '\0';
+        editorInitRow(&batch[n++], chars, e - p, 0);
+        if (n == ROW_BATCH) {
+          editorInsertRows(config.numrows, batch, n);
+          n = 0;
+        }
+      }
+      f->partial = nl == NULL;
+      p = nl ? nl + 1 : end;
+    }
+    // the next read may carry on the last row, so it has to be in place
+    editorInsertRows(config.numrows, batch, n);
+  }
+  f->more = got > 0;     // poll won't wait, see editorNextTimeout
+
+  config.dirty = 0;
+  if (atend) {
+    config.cy = config.numrows - 1;
+    config.cx = 0;
+  }
+}
+
+void followStart() {
+  struct follow *f = &config.follow;
+  if (config.disk.st_ino == 0) {
+    editorSetStatusMessage("Only regular files can be followed");
+    f->on = 0;
+    swapStart(1);
+    return;
+  }
+
+  editorLoadAll();   // new rows go after the last one
+  f->fd = open(config.filename, O_RDONLY | O_CLOEXEC);
+  f->ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (f->fd == -1 || f->ifd == -1 ||
+      inotify_add_watch(f->ifd, config.filename, IN_MODIFY) == -1)
+    die("follow");
+
+  // editorOpen read what was mapped, or nothing for an empty file, whose
+  // single blank row is the first line to come
+  f->off = config.maplen;
+  f->partial = config.maplen == 0 || config.map[config.maplen - 1] != '\n';
+  followRead();   // anything written since editorOpen looked
+}
+
+// drop the queued inotify events, followRead looks at the file itself
+void followDrain() {
+  char buf[4096];
+  while (read(config.follow.ifd, buf, sizeof(buf)) > 0);
+}
+
+// keys that would change the buffer, refused while following
+bool followBlocks(int16_t c) {
+  switch (c) {
+    case CTRL_KEY('s'):
+    case CTRL_KEY('r'):
+    case CTRL_KEY('d'):
+    case KEY_PASTE:
+      return 1;
+    case 'i': case 'a': case 'A': case ';': case 'o': case 'O':
+    case 'u': case ':':
+      return config.mode == MODE_NORMAL;
+  }
+  return config.mode == MODE_INSERT;
+}
+
+/*** regex ***/
+
+/*
+ * search patterns are parsed into a small tree and compiled into a
+ * thompson nfa. matching runs a dfa that is built lazily from sets of
+ * nfa states: a dfa state is created the first time a scan reaches it
+ * and its transitions are filled in as bytes are seen, so once the
+ * cache is warm each byte costs one table lookup. every thread keeps
+ * its own dfa over the shared, read-only nfa. the cache is flushed when
+ * it holds DFA_MAX_STATES states, which bounds memory on patterns whose
+ * dfa would blow up.
+ *
+ * supported: literals, ., [] classes with ranges and ^, \d \w \s and
+ * their negations, ^ $, ( ), |, * + ?. whole-word mode rejects matches
+ * that touch a word character on either side, like grep -w.
+ */
+
+enum PatternNode {
+  RE_EMPTY,
+  RE_SET,           // one byte out of set
+  RE_CAT,
+  RE_ALT,
+  RE_STAR,
+  RE_PLUS,
+  RE_QUEST,
+  RE_BOL,
+  RE_EOL,
+};
+
+enum NfaOp {
+  NFA_SET,
+  NFA_SPLIT,
+  NFA_BOL,
+  NFA_EOL,
+  NFA_MATCH,
+};
+
+// entries of a leftmost dfa state that are not nfa states
+enum DfaList {
+  DFA_MARK = -1,      // ends the threads of one start column
+  DFA_STARTING = -2,  // heads a list that still starts new columns
+  DFA_STARTED = -3,   // heads a list that starts no more
+};
+
+typedef struct renode {
+  int16_t op;
+  int16_t left, right;
+  uint8_t set[32];
+} renode;
+
+struct reparser {
+  const char *p;
+  renode *nodes;
+  int16_t n;
+  bool icase;
+  bool literal;     // every character stands for itself
+  const char *error;
+};
+
+void setAdd(uint8_t *set, unsigned char c) {
+  set[c >> 3] |= 1 << (c & 7);
+}
+
+bool setHas(const uint8_t *set, unsigned char c) {
+  return (set[c >> 3] >> (c & 7)) & 1;
+}
+
+void setAddRange(uint8_t *set, unsigned char lo, unsigned char hi) {
+  for (int16_t c = lo; c <= hi; c++) setAdd(set, c);
+}
+
+void setFoldCase(uint8_t *set) {
+  for (int16_t c = 'a'; c <= 'z'; c++) {
+    if (setHas(set, c) || setHas(set, toupper(c))) {
+      setAdd(set, c);
+      setAdd(set, toupper(c));
+    }
+  }
+}
+
+bool isWordChar(unsigned char c) {
+  return isalnum(c) || c == '_';
+}
+
+int16_t reNode(struct reparser *rp, int16_t op, int16_t left, int16_t right) {
+  renode *node = &rp->nodes[rp->n];
+  memset(node, 0, sizeof(*node));
+  node->op = op;
+  node->left = left;
+  node->right = right;
+  return rp->n++;
+}
+
+// \d \w \s and friends, or the escaped character itself
+void reEscapeSet(uint8_t *set, unsigned char c) {
+  uint8_t tmp[32] = {0};
+  switch (tolower(c)) {
+    case 'd': setAddRange(tmp, '0', '9'); break;
+    case 'w':
+      for (int16_t i = 0; i < 256; i++) if (isWordChar(i)) setAdd(tmp, i);
+      break;
+    case 's':
+      for (int16_t i = 0; i < 256; i++) if (isspace(i)) setAdd(tmp, i);
+      break;
+    case 't': setAdd(set, '\t'); return;
+    default: setAdd(set, c); return;
+  }
+  bool negate = isupper(c) != 0;
+  for (int16_t i = 0; i < 32; i++) set[i] |= negate ? ~tmp[i] : tmp[i];
+}
+
+int16_t reParseClass(struct reparser *rp) {
+  int16_t node = reNode(rp, RE_SET, -1, -1);
+  uint8_t *set = rp->nodes[node].set;
+  bool negate = *rp->p == '^';
+  if (negate) rp->p++;
+
+  bool first = 1;
+  while (*rp->p && (*rp->p != ']' || first)) {
+    unsigned char lo = *rp->p++;
+    first = 0;
+    if (lo == '\\') {
+      if (*rp->p == '\0') break;
+      reEscapeSet(set, *rp->p++);
+      continue;
+    }
+    if (rp->p[0] == '-' && rp->p[1] && rp->p[1] != ']') {
+      unsigned char hi = rp->p[1];
+      rp->p += 2;
+      if (hi < lo) {
+        rp->error = "bad range";
+        return node;
+      }
+      setAddRange(set, lo, hi);
+    } else {
+      setAdd(set, lo);
+    }
+  }
+  if (*rp->p != ']') {
+    rp->error = "missing ]";
+    return node;
+  }
+  rp->p++;
+  if (rp->icase) setFoldCase(set);
+  if (negate) for (int16_t i = 0; i < 32; i++) set[i] = ~set[i];
+  return node;
+}
+
+int16_t reParseAlt(struct reparser *rp);
+
+int16_t reParseAtom(struct reparser *rp) {
+  unsigned char c = *rp->p++;
+  int16_t node;
+
+  if (rp->literal) {
+    node = reNode(rp, RE_SET, -1, -1);
+    setAdd(rp->nodes[node].set, c);
+  } else if (c == '(') {
+    node = reParseAlt(rp);
+    if (*rp->p != ')') rp->error = "missing )";
+    else rp->p++;
+    return node;
+  } else if (c == '[') {
+    return reParseClass(rp);
+  } else if (c == '.') {
+    node = reNode(rp, RE_SET, -1, -1);
+    memset(rp->nodes[node].set, 0xff, 32);
+  } else if (c == '^' || c == '$') {
+    return reNode(rp, c == '^' ? RE_BOL : RE_EOL, -1, -1);
+  } else if (c == '*' || c == '+' || c == '?') {
+    rp->error = "nothing to repeat";
+    return reNode(rp, RE_EMPTY, -1, -1);
+  } else {
+    node = reNode(rp, RE_SET, -1, -1);
+    if (c == '\\') {
+      if (*rp->p == '\0') {
+        rp->error = "trailing \\";
+        return node;
+      }
+      reEscapeSet(rp->nodes[node].set, *rp->p++);
+    } else {
+      setAdd(rp->nodes[node].set, c);
+    }
+  }
+
+  if (rp->icase) setFoldCase(rp->nodes[node].set);
+  return node;
+}
+
+int16_t reParseRepeat(struct reparser *rp) {
+  int16_t node = reParseAtom(rp);
+  while (!rp->literal && *rp->p && strchr("*+?", *rp->p)) {
+    char q = *rp->p++;
+    node = reNode(rp, q == '*' ? RE_STAR : q == '+' ? RE_PLUS : RE_QUEST,
+                  node, -1);
+  }
+  return node;
+}
+
+int16_t reParseCat(struct reparser *rp) {
+  int16_t node = reNode(rp, RE_EMPTY, -1, -1);
+  while (*rp->p && !rp->error &&
+         (rp->literal || (*rp->p != '|' && *rp->p != ')'))) {
+    int16_t next = reParseRepeat(rp);
+    node = reNode(rp, RE_CAT, node, next);
+  }
+  return node;
+}
+
+int16_t reParseAlt(struct reparser *rp) {
+  int16_t node = reParseCat(rp);
+  while (*rp->p == '|' && !rp->literal && !rp->error) {
+    rp->p++;
+    int16_t right = reParseCat(rp);
+    node = reNode(rp, RE_ALT, node, right);
+  }
+  return node;
+}
+
+int16_t nfaState(pattern *re, int16_t op, int16_t out, int16_t out1) {
+  nfastate *st = &re->states[re->n];
+  st->op = op;
+  st->out = out;
+  st->out1 = out1;
+  return re->n++;
+}
+
+/*
+ * compile node so that it continues into state next, returns its start.
+ * a reversed pattern reads concatenations back to front, and ^ and $
+ * trade places.
+ */
+int16_t reCompile(pattern *re, renode *nodes, int16_t node, int16_t next) {
+  renode *nd = &nodes[node];
+  int16_t s;
+  switch (nd->op) {
+    case RE_SET:
+      s = nfaState(re, NFA_SET, next, -1);
+      memcpy(re->states[s].set, nd->set, 32);
+      return s;
+    case RE_CAT:
+      if (re->reversed)
+        return reCompile(re, nodes, nd->right,
+                         reCompile(re, nodes, nd->left, next));
+      return reCompile(re, nodes, nd->left,
+                       reCompile(re, nodes, nd->right, next));
+    case RE_ALT:
+      return nfaState(re, NFA_SPLIT, reCompile(re, nodes, nd->left, next),
+                      reCompile(re, nodes, nd->right, next));
+    case RE_STAR:
+      s = nfaState(re, NFA_SPLIT, -1, next);
+      re->states[s].out = reCompile(re, nodes, nd->left, s);
+      return s;
+    case RE_PLUS:
+      s = nfaState(re, NFA_SPLIT, -1, next);
+      re->states[s].out = reCompile(re, nodes, nd->left, s);
+      return re->states[s].out;
+    case RE_QUEST:
+      return nfaState(re, NFA_SPLIT, reCompile(re, nodes, nd->left, next),
+                      next);
+    case RE_BOL:
+      return nfaState(re, re->reversed ? NFA_EOL : NFA_BOL, next, -1);
+    case RE_EOL:
+      return nfaState(re, re->reversed ? NFA_BOL : NFA_EOL, next, -1);
+    default:
+      return next;
+  }
+}
+
+pattern *patternBuild(renode *nodes, int16_t n, int16_t root, bool word,
+                      bool reversed) {
+  pattern *re = malloc(sizeof(pattern));
+  re->states = calloc(n + 3, sizeof(nfastate));
+  re->n = 0;
+  re->word = word;
+  re->reversed = reversed;
+  re->back = NULL;
+  int16_t match = nfaState(re, NFA_MATCH, -1, -1);
+  re->start = reCompile(re, nodes, root, match);
+
+  // the unanchored entry skips any prefix before trying start
+  re->ustart = nfaState(re, NFA_SPLIT, -1, re->start);
+  int16_t any = nfaState(re, NFA_SET, re->ustart, -1);
+  memset(re->states[any].set, 0xff, 32);
+  re->states[re->ustart].out = any;
+  return re;
+}
+
+/*
+ * compile query, literally unless regex is set. returns NULL and points
+ * *error at a message when the pattern does not parse.
+ */
+pattern *patternCompile(const char *query, bool regex, bool icase, bool word,
+                        const char **error) {
+  size_t len = strlen(query);
+  struct reparser rp = {query, malloc((2 * len + 2) * sizeof(renode)), 0,
+                        icase, !regex, NULL};
+  int16_t root = reParseAlt(&rp);
+  if (!rp.error && *rp.p) rp.error = "unmatched )";
+  if (rp.error) {
+    *error = rp.error;
+    free(rp.nodes);
+    return NULL;
+  }
+
+  pattern *re = patternBuild(rp.nodes, rp.n, root, word, 0);
+  re->back = patternBuild(rp.nodes, rp.n, root, word, 1);
+  free(rp.nodes);
+  return re;
+}
+
+void patternFree(pattern *re) {
+  if (re == NULL) return;
+  patternFree(re->back);
+  free(re->states);
+  free(re);
+}
+
+// drop every cached state
+void dfaFlush(dfa *d) {
+  for (int32_t i = 0; i < d->n; i++) free(d->states[i].set);
+  d->n = 0;
+  d->flushes++;
+  for (int32_t i = 0; i < DFA_TABLE_SIZE; i++) d->table[i] = -1;
+  d->start[0] = d->start[1] = d->ustart = -1;
+  d->lstart[0] = d->lstart[1] = d->lstart[2] = -1;
+}
+
+void dfaInit(dfa *d, pattern *re) {
+  memset(d, 0, sizeof(*d));
+  d->re = re;
+  d->states = malloc(DFA_MAX_STATES * sizeof(dfastate));
+  d->table = malloc(DFA_TABLE_SIZE * sizeof(int32_t));
+  d->seen = calloc(re->n, sizeof(uint32_t));
+  d->stack = malloc((re->n * 2 + 1) * sizeof(int16_t));
+  d->set = malloc((re->n * 2 + 2) * sizeof(int16_t));  // room for marks
+  dfaFlush(d);
+  if (re->back) {
+    d->back = malloc(sizeof(dfa));
+    dfaInit(d->back, re->back);
+  }
+}
+
+void dfaFree(dfa *d) {
+  if (d->re == NULL) return;
+  if (d->back) dfaFree(d->back);
+  free(d->back);
+  for (int32_t i = 0; i < d->n; i++) free(d->states[i].set);
+  free(d->states);
+  free(d->table);
+  free(d->seen);
+  free(d->stack);
+  free(d->set);
+  memset(d, 0, sizeof(*d));
+}
+
+// add the closure of nfa state s to d->set, following bol/eol if allowed
+void dfaAddClosure(dfa *d, int16_t s, bool bol, bool eol) {
+  int16_t top = 0;
+  d->stack[top++] = s;
+  while (top) {
+    s = d->stack[--top];
+    if (s < 0 || d->seen[s] == d->epoch) continue;
+    d->seen[s] = d->epoch;
+    nfastate *st = &d->re->states[s];
+    switch (st->op) {
+      case NFA_SPLIT:
+        d->stack[top++] = st->out1;
+        d->stack[top++] = st->out;
+        break;
+      case NFA_BOL:
+        if (bol) d->stack[top++] = st->out;
+        break;
+      case NFA_EOL:
+        d->set[d->nset++] = s;    // kept to check at the end of the row
+        if (eol) d->stack[top++] = st->out;
+        break;
+      default:
+        d->set[d->nset++] = s;
+        break;
+    }
+  }
+}
+
+int compareState(const void *a, const void *b) {
+  return *(const int16_t *) a - *(const int16_t *) b;
+}
+
+// find or create the dfa state for d->set, kept in order if it is a list
+int32_t dfaLookup(dfa *d) {
+  if (d->nset && d->set[0] >= 0)
+    qsort(d->set, d->nset, sizeof(int16_t), compareState);
+  uint32_t h = 2166136261u;
+  for (int16_t i = 0; i < d->nset; i++) h = (h ^ d->set[i]) * 16777619u;
+
+  uint32_t slot = h & (DFA_TABLE_SIZE - 1);
+  for (; d->table[slot] != -1; slot = (slot + 1) & (DFA_TABLE_SIZE - 1)) {
+    dfastate *st = &d->states[d->table[slot]];
+    if (st->hash == h && st->n == d->nset &&
+        memcmp(st->set, d->set, d->nset * sizeof(int16_t)) == 0)
+      return d->table[slot];
+  }
+
+  if (d->n == DFA_MAX_STATES) {
+    dfaFlush(d);
+    return dfaLookup(d);
+  }
+
+  int32_t idx = d->n++;
+  dfastate *st = &d->states[idx];
+  st->set = malloc(d->nset * sizeof(int16_t) + 1);
+  memcpy(st->set, d->set, d->nset * sizeof(int16_t));
+  st->n = d->nset;
+  st->hash = h;
+  st->accept = 0;
+  st->accept_eol = -1;
+  for (int16_t i = 0; i < d->nset; i++)
+    if (d->set[i] >= 0 && d->re->states[d->set[i]].op == NFA_MATCH)
+      st->accept = 1;
+  for (int16_t i = 0; i < 256; i++) st->next[i] = -1;
+  d->table[slot] = idx;
+  return idx;
+}
+
+/*
+ * start state for a match beginning at column 0 (bol) or later. the
+ * unanchored start is only used from column 0.
+ */
+int32_t dfaStart(dfa *d, bool bol, bool anchored) {
+  int32_t *slot = anchored ? &d->start[bol] : &d->ustart;
+  if (*slot != -1) return *slot;
+
+  d->epoch++;
+  d->nset = 0;
+  dfaAddClosure(d, anchored ? d->re->start : d->re->ustart, bol, 0);
+  return *slot = dfaLookup(d);
+}
+
+int32_t dfaStep(dfa *d, int32_t from, unsigned char c) {
+  int32_t to = d->states[from].next[c];
+  if (to != -1) return to;
+
+  dfastate *st = &d->states[from];
+  d->epoch++;
+  d->nset = 0;
+  for (int16_t i = 0; i < st->n; i++) {
+    nfastate *ns = &d->re->states[st->set[i]];
+    if (ns->op == NFA_SET && setHas(ns->set, c))
+      dfaAddClosure(d, ns->out, 0, 0);
+  }
+
+  uint32_t flushes = d->flushes;
+  to = dfaLookup(d);
+  if (d->flushes == flushes) d->states[from].next[c] = to;
+  return to;
+}
+
+/*
+ * leftmost-longest matching keeps its states as lists rather than sets:
+ * the threads of each start column in turn, earliest column first, each
+ * column closed by a DFA_MARK. a thread reached from two columns stays
+ * with the earlier one. once a match ends, the columns after the one it
+ * belongs to cannot give the leftmost match, so they are dropped and no
+ * new ones are started; the list runs on until the columns before it
+ * and its own longest match are settled.
+ */
+int32_t dfaLeftStart(dfa *d, bool bol, bool start) {
+  int32_t *slot = &d->lstart[start ? 1 + bol : 0];
+  if (*slot != -1) return *slot;
+
+  d->epoch++;
+  d->nset = 0;
+  d->set[d->nset++] = DFA_STARTING;
+  if (start) dfaAddClosure(d, d->re->start, bol, 0);
+  return *slot = dfaLookup(d);
+}
+
+// word mode only lets a match end before c, or start after it, off a word
+bool dfaWordOk(dfa *d, unsigned char c) {
+  return !d->re->word || !isWordChar(c);
+}
+
+int32_t dfaLeftStep(dfa *d, int32_t from, unsigned char c) {
+  int32_t to = d->states[from].next[c];
+  if (to != -1) return to;
+
+  dfastate *st = &d->states[from];
+  bool starting = st->set[0] == DFA_STARTING;
+  int16_t n = st->n;
+  if (st->accept && dfaWordOk(d, c)) {
+    // keep the columns up to the end of the first one that matched
+    n = 1;
+    while (st->set[n] < 0 || d->re->states[st->set[n]].op != NFA_MATCH) n++;
+    while (n < st->n && st->set[n] != DFA_MARK) n++;
+    starting = 0;
+  }
+
+  d->epoch++;
+  d->nset = 0;
+  d->set[d->nset++] = starting ? DFA_STARTING : DFA_STARTED;
+  for (int16_t i = 1; i < n; i++) {
+    if (st->set[i] == DFA_MARK) {
+      if (d->set[d->nset - 1] >= 0) d->set[d->nset++] = DFA_MARK;
+      continue;
+    }
+    nfastate *ns = &d->re->states[st->set[i]];
+    if (ns->op == NFA_SET && setHas(ns->set, c))
+      dfaAddClosure(d, ns->out, 0, 0);
+  }
+  if (starting && dfaWordOk(d, c)) {
+    if (d->set[d->nset - 1] >= 0) d->set[d->nset++] = DFA_MARK;
+    dfaAddClosure(d, d->re->start, 0, 0);
+  }
+  if (d->set[d->nset - 1] == DFA_MARK) d->nset--;
+  if (!starting && d->nset == 1) d->nset = 0;   // nothing left to match
+
+  uint32_t flushes = d->flushes;
+  to = dfaLookup(d);
+  if (d->flushes == flushes) d->states[from].next[c] = to;
+  return to;
+}
+
+bool dfaAcceptEol(dfa *d, int32_t idx) {
+  dfastate *st = &d->states[idx];
+  if (st->accept_eol != -1) return st->accept_eol;
+
+  d->epoch++;
+  d->nset = 0;
+  for (int16_t i = 0; i < st->n; i++)
+    if (st->set[i] >= 0 && d->re->states[st->set[i]].op == NFA_EOL)
+      dfaAddClosure(d, d->re->states[st->set[i]].out, 0, 1);
+  st->accept_eol = st->accept;
+  for (int16_t i = 0; i < d->nset; i++)
+    if (d->re->states[d->set[i]].op == NFA_MATCH) st->accept_eol = 1;
+  return st->accept_eol;
+}
+
+// does the pattern match anywhere in s
+bool patternSearchable(dfa *d, const char *s, int64_t len) {
+  int32_t st = dfaStart(d, 1, 0);
+  for (int64_t i = 0; i < len; i++) {
+    if (d->states[st].accept) return 1;
+    if (i % SEARCH_BLOCK == 0 && d->gen && !searchCurrent(d->gen)) return 0;
+    st = dfaStep(d, st, s[i]);
+  }
+  return d->states[st].accept || dfaAcceptEol(d, st);
+}
+
+/*
+ * where the match ending at end starts, at from or later: the reversed
+ * pattern is run back from end, and the furthest column it accepts at
+ * is the leftmost start.
+ */
+int64_t patternStartOf(dfa *b, const char *s, int64_t len, int64_t from,
+                       int64_t end) {
+  int32_t st = dfaStart(b, end == len, 1);
+  int64_t start = -1;
+  for (int64_t i = end; ; i--) {
+    dfastate *ds = &b->states[st];
+    if (ds->n == 0) break;
+    if (i == 0) {
+      if (dfaAcceptEol(b, st)) start = 0;
+      break;
+    }
+    if (ds->accept && dfaWordOk(b, s[i - 1])) start = i;
+    if (i == from) break;
+    st = dfaStep(b, st, s[i - 1]);
+  }
+  return start;
+}
+
+/*
+ * first match at or after from: its start, with the end in *end, or -1.
+ * one pass forward finds where the leftmost-longest match ends, and one
+ * back over just the match finds where it starts.
+ */
+int64_t patternFind(dfa *d, const char *s, int64_t len, int64_t from,
+                    int64_t *end) {
+  bool start = from == 0 || dfaWordOk(d, s[from - 1]);
+  int32_t st = dfaLeftStart(d, from == 0, start);
+  int64_t e = -1;
+  for (int64_t i = from; ; i++) {
+    dfastate *ds = &d->states[st];
+    if (ds->n == 0) break;
+    if (i == len) {
+      if (dfaAcceptEol(d, st)) e = len;
+      break;
+    }
+    if (ds->accept && dfaWordOk(d, s[i])) e = i;
+    if (i % SEARCH_BLOCK == 0 && d->gen && !searchCurrent(d->gen)) return -1;
+    st = dfaLeftStep(d, st, s[i]);
+  }
+  if (e == -1) return -1;
+  *end = e;
+  return patternStartOf(d->back, s, len, from, e);
+}
+
+/*** search ***/
+
+/*
+ * the query is matched against the raw row chars. rows that still live
+ * in the file mapping sit back to back, so runs of them are scanned as
+ * one block instead of restarting the scan on every short line.
+ *
+ * the rows are cut into chunks of about SEARCH_CHUNK bytes that a pool
+ * of worker threads claims one at a time. a finished chunk publishes its
+ * matching rows and wakes the event loop, so counts and the first match
+ * show up while the rest of the file is still being scanned.
+ *
+ * workers read rows only while gen is still that of their job. anything
+ * that changes rows calls searchInvalidate first: edits, undo, :s, and
+ * followRead and the mapped file loader appending rows while the prompt
+ * is open. that bumps gen through searchCancel, which workers notice
+ * within SEARCH_BLOCK bytes, even inside one long row, and searchCancel
+ * waits until they have all let go before the rows are touched. the
+ * index is rebuilt by searchResume once the changes pause.
+ */
+
+// first occurrence of needle in hay, or NULL
+char *searchFind(char *hay, size_t len, const char *needle, size_t nlen) {
+  if (nlen == 0 || nlen > len) return NULL;
+  char *p = hay;
+  char *last = hay + len - nlen;    // last possible start
+
+#ifdef __SSE2__
+  // keep positions where both the first and the last byte line up
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i final = _mm_set1_epi8(needle[nlen - 1]);
+  while (p + 15 <= last) {
+    __m128i a = _mm_loadu_si128((const __m128i *) p);
+    __m128i b = _mm_loadu_si128((const __m128i *) (p + nlen - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(p + bit + 1, needle + 1, nlen - 1) == 0) return p + bit;
+      mask &= mask - 1;
+    }
+    p += 16;
+  }
+#endif
+
+  while (p <= last) {
+    p = memchr(p, needle[0], last - p + 1);
+    if (p == NULL) return NULL;
+    if (memcmp(p + 1, needle + 1, nlen - 1) == 0) return p;
+    p++;
+  }
+  return NULL;
+}
+
+/*
+ * first match in row at or after from: its start, with the end in *end,
+ * or -1. d is the calling thread's dfa, NULL for plain literal queries.
+ */
+int64_t searchRowFind(dfa *d, erow *row, int64_t from, int64_t *end) {
+  struct search *s = &config.search;
+  if (d) return patternFind(d, row->chars, row->size, from, end);
+
+  char *p = searchFind(row->chars + from, row->size - from,
+                       s->query, s->qlen);
+  if (p == NULL) return -1;
+  *end = p - row->chars + s->qlen;
+  return p - row->chars;
+}
+
+int64_t searchCountRow(dfa *d, erow *row) {
+  if (d && !patternSearchable(d, row->chars, row->size)) return 0;
+
+  int64_t count = 0, at = 0, end;
+  while (at <= row->size && (at = searchRowFind(d, row, at, &end)) != -1) {
+    count++;
+    at = end > at ? end : at + 1;   // step over empty matches
+  }
+  return count;
+}
+
+bool searchCurrent(uint64_t gen) {
+  return __atomic_load_n(&config.search.gen, __ATOMIC_ACQUIRE) == gen;
+}
+
+void searchChunkAdd(struct searchchunk *ch, int64_t at, int64_t count) {
+  if (ch->nrows == ch->cap) {
+    ch->cap = ch->cap ? ch->cap * 2 : 64;
+    ch->rows = realloc(ch->rows, ch->cap * sizeof(int64_t));
+    ch->counts = realloc(ch->counts, ch->cap * sizeof(int32_t));
+  }
+  ch->counts[ch->nrows] = count;
+  ch->rows[ch->nrows++] = at;
+  ch->matches += count;
+}
+
+void searchScanChunk(struct searchchunk *ch, int64_t from, int64_t to,
+                     uint64_t gen, dfa *d) {
+  struct search *s = &config.search;
+  rowiter it;
+  int64_t at = from;
+  erow *row = editorRowIterStart(&it, from);
+
+  if (d) {
+    for (; row && at < to; row = editorRowIterNext(&it), at++) {
+      if (at % 1024 == 0 && !searchCurrent(gen)) return;
+      int64_t count = searchCountRow(d, row);
+      if (count) searchChunkAdd(ch, at, count);
+    }
+    return;
+  }
+
+  while (row && at < to && searchCurrent(gen)) {
+    rowiter cur = it;
+    int64_t cur_at = at;
+    char *end = row->chars + row->size;
+    erow *last = row, *next = NULL;
+
+    // extend the block over rows separated only by their line ending
+    while (++at < to) {
+      next = editorRowIterNext(&it);
+      if (!last->mapped || !next->mapped || next->chars <= end ||
+          next->chars - end > 2)
+        break;
+      end = next->chars + next->size;
+      last = next;
+      next = NULL;
+    }
+
+    erow *r = row;
+    int64_t count = 0;
+    char *p = row->chars;
+    size_t window = SEARCH_BLOCK + s->qlen - 1;
+    while (p < end) {
+      if (!searchCurrent(gen)) return;
+      // at most SEARCH_BLOCK starts at a time, the block may be long
+      size_t ahead = end - p;
+      if (ahead > window) ahead = window;
+      char *hit = searchFind(p, ahead, s->query, s->qlen);
+      if (hit == NULL) {
+        if (ahead < window) break;
+        p += SEARCH_BLOCK;
+        continue;
+      }
+      p = hit;
+
+      // line endings never match, so every hit lies inside one row
+      while (p >= r->chars + r->size) {
+        if (count) searchChunkAdd(ch, cur_at, count);
+        count = 0;
+        r = editorRowIterNext(&cur);
+        cur_at++;
+      }
+      count++;
+      p += s->qlen;
+    }
+    if (count) searchChunkAdd(ch, cur_at, count);
+
+    row = next;
+  }
+}
+
+// recheck only the rows that matched a prefix of the query
+void searchNarrowChunk(struct searchchunk *ch, struct searchchunk *prev,
+                       uint64_t gen, dfa *d) {
+  for (int64_t i = 0; i < prev->nrows && searchCurrent(gen); i++) {
+    int64_t count = searchCountRow(d, editorRowAt(prev->rows[i]));
+    if (count) searchChunkAdd(ch, prev->rows[i], count);
+  }
+}
+
+void searchRunChunk(int64_t c, uint64_t gen, dfa *d) {
+  struct search *s = &config.search;
+  struct searchchunk *ch = &s->chunks[c];
+  struct searchchunk *prev = s->prev ? &s->prev[c] : NULL;
+
+  if (prev && __atomic_load_n(&prev->done, __ATOMIC_ACQUIRE)) {
+    searchNarrowChunk(ch, prev, gen, d);
+  } else {
+    searchScanChunk(ch, s->bounds[c], s->bounds[c + 1], gen, d);
+  }
+
+  if (searchCurrent(gen)) {
+    __atomic_store_n(&ch->done, 1, __ATOMIC_RELEASE);
+    editorWake();
+  }
+}
+
+void *searchWorker(void *arg) {
+  struct search *s = &config.search;
+  uint64_t seen = 0;
+  dfa d = {0};      // this thread's cache over the job's pattern
+  (void) arg;
+
+  pthread_mutex_lock(&s->lock);
+  while (1) {
+    while (!s->posted || s->gen == seen)
+      pthread_cond_wait(&s->work, &s->lock);
+    seen = s->gen;
+    s->busy++;
+    pthread_mutex_unlock(&s->lock);
+
+    dfaFree(&d);
+    if (s->re) dfaInit(&d, s->re);
+    d.gen = seen;
+
+    int64_t c;
+    while (searchCurrent(seen) &&
+           (c = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED)) < s->nchunks)
+      searchRunChunk(c, seen, s->re ? &d : NULL);
+
+    pthread_mutex_lock(&s->lock);
+    if (--s->busy == 0) pthread_cond_signal(&s->idle);
+  }
+  return NULL;
+}
+
+void searchStartPool() {
+  struct search *s = &config.search;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  s->nthreads = cpus < 1 ? 1 : cpus > SEARCH_THREADS ? SEARCH_THREADS : cpus;
+
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work, NULL);
+  pthread_cond_init(&s->idle, NULL);
+  s->threads = malloc(s->nthreads * sizeof(pthread_t));
+  for (int16_t i = 0; i < s->nthreads; i++)
+    if (pthread_create(&s->threads[i], NULL, searchWorker, NULL) != 0)
+      die("pthread_create");
+}
+
+// stop the running job and wait until no worker touches its chunks
+void searchCancel() {
+  struct search *s = &config.search;
+  if (s->threads == NULL) {
+    s->gen++;
+    return;
+  }
+  pthread_mutex_lock(&s->lock);
+  s->posted = 0;
+  __atomic_add_fetch(&s->gen, 1, __ATOMIC_RELEASE);
+  while (s->busy) pthread_cond_wait(&s->idle, &s->lock);
+  pthread_mutex_unlock(&s->lock);
+}
+
+void searchFreeChunks(struct searchchunk *chunks, int64_t n) {
+  if (chunks == NULL) return;
+  for (int64_t i = 0; i < n; i++) {
+    free(chunks[i].rows);
+    free(chunks[i].counts);
+  }
+  free(chunks);
+}
+
+/*
+ * cut the rows into chunks of about SEARCH_CHUNK bytes. walking every
+ * row takes a while on big files, so the cut is kept until rows change.
+ */
+void searchCutChunks() {
+  struct search *s = &config.search;
+  if (s->cut) return;
+  int64_t cap = 16, bytes = 0, y = 0;
+  s->bounds = realloc(s->bounds, cap * sizeof(int64_t));
+  s->bounds[0] = 0;
+  s->ncut = 0;
+  s->bytes = 0;
+
+  rowiter it;
+  for (erow *row = editorRowIterStart(&it, 0); row;
+       row = editorRowIterNext(&it)) {
+    bytes += row->size + 1;
+    if (++y < config.numrows && bytes < SEARCH_CHUNK) continue;
+    if (s->ncut + 2 > cap) {
+      cap *= 2;
+      s->bounds = realloc(s->bounds, cap * sizeof(int64_t));
+    }
+    s->bounds[++s->ncut] = y;
+    s->bytes += bytes;
+    bytes = 0;
+  }
+  s->cut = 1;
+}
+
+// the chunk holding row y
+int64_t searchChunkOf(int64_t y) {
+  struct search *s = &config.search;
+  int64_t lo = 0, hi = s->nchunks;
+  while (hi - lo > 1) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (s->bounds[mid] <= y) lo = mid;
+    else hi = mid;
+  }
+  return lo;
+}
+
+// the ui thread's dfa, NULL for plain literal queries
+dfa *searchDfa() {
+  return config.search.re ? &config.search.dfa : NULL;
+}
+
+void searchStart(const char *query) {
+  struct search *s = &config.search;
+  size_t qlen = strlen(query);
+  if (s->query && qlen == s->qlen && memcmp(query, s->query, qlen) == 0 &&
+      s->qmode == s->mode)
+    return;
+
+  searchCancel();
+
+  // a longer literal only matches rows the shorter one matched
+  bool narrow = s->query && s->cut && qlen > s->qlen && s->qmode == s->mode &&
+                !(s->mode & (SEARCH_REGEX | SEARCH_WORD)) &&
+                memcmp(query, s->query, s->qlen) == 0;
+  searchFreeChunks(s->prev, s->nchunks);
+  s->prev = NULL;
+  if (narrow) s->prev = s->chunks;
+  else searchFreeChunks(s->chunks, s->nchunks);
+
+  free(s->query);
+  s->query = strdup(query);
+  s->qlen = qlen;
+  s->qmode = s->mode;
+  s->stale = s->recount = 0;
+  s->version++;
+  searchCutChunks();
+  s->nchunks = s->ncut;
+  s->chunks = calloc(s->nchunks, sizeof(struct searchchunk));
+
+  dfaFree(&s->dfa);
+  patternFree(s->re);
+  s->re = NULL;
+  s->error = NULL;
+  if (qlen && s->mode) {
+    s->re = patternCompile(query, s->mode & SEARCH_REGEX,
+                           s->mode & SEARCH_ICASE, s->mode & SEARCH_WORD,
+                           &s->error);
+    if (s->re) dfaInit(&s->dfa, s->re);
+  }
+
+  if (qlen == 0 || s->error) {
+    for (int64_t c = 0; c < s->nchunks; c++) s->chunks[c].done = 1;
+    return;
+  }
+
+  // a small buffer is quicker to scan than to hand over
+  if (s->bytes <= SEARCH_INLINE) {
+    for (int64_t c = 0; c < s->nchunks; c++)
+      searchRunChunk(c, s->gen, searchDfa());
+    return;
   }
 
-  return buf;
+  if (s->threads == NULL) searchStartPool();
+  pthread_mutex_lock(&s->lock);
+  s->next = 0;
+  s->posted = 1;
+  __atomic_add_fetch(&s->gen, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&s->work);
+  pthread_mutex_unlock(&s->lock);
+}
 
+bool searchChunkDone(int64_t c) {
+  return __atomic_load_n(&config.search.chunks[c].done, __ATOMIC_ACQUIRE);
 }
 
-void editorOpen(char *filename) {
-  free(config.filename);
-  config.filename = strdup(filename); 
+// index of the first row in ch at or after row at
+int64_t searchChunkIndex(struct searchchunk *ch, int64_t at) {
+  int64_t lo = 0, hi = ch->nrows;
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (ch->rows[mid] < at) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
 
-  FILE *fp = fopen(filename, "r");
-  if (fp == NULL) die("fopen");
+// nearest matching row after (or before) row at, wrapping; -1 if none
+int64_t searchNextRow(int64_t at, int16_t direction) {
+  struct search *s = &config.search;
+  int64_t k = searchChunkOf(at);
+
+  for (int64_t step = 0; step <= s->nchunks; step++) {
+    int64_t c = ((k + direction * step) % s->nchunks + s->nchunks) % s->nchunks;
+    if (!searchChunkDone(c)) continue;
+    struct searchchunk *ch = &s->chunks[c];
+    if (ch->nrows == 0) continue;
+
+    if (step == 0) {
+      int64_t i = searchChunkIndex(ch, direction > 0 ? at + 1 : at);
+      if (direction > 0 && i < ch->nrows) return ch->rows[i];
+      if (direction < 0 && i > 0) return ch->rows[i - 1];
+      continue;
+    }
+    return direction > 0 ? ch->rows[0] : ch->rows[ch->nrows - 1];
+  }
+  return -1;
+}
 
-  char *line = NULL;
-  size_t linecap = 0;
-  ssize_t linelen;
+/*
+ * move to the next match after the cursor, or the previous one before
+ * it, wrapping around the file. returns false when nothing matches.
+ */
+bool searchStep(int16_t direction) {
+  struct search *s = &config.search;
+  if (s->qlen == 0 || s->error || s->nchunks == 0) return 0;
+
+  dfa *d = searchDfa();
+  erow *row = editorRowAt(config.cy);
+  int64_t at = 0, end, hit = -1;
+  while (at <= row->size && (at = searchRowFind(d, row, at, &end)) != -1) {
+    if (direction > 0 && at > config.cx) {
+      hit = at;
+      break;
+    }
+    if (direction < 0 && at >= config.cx) break;
+    if (direction < 0) hit = at;
+    at = end > at ? end : at + 1;
+  }
 
-  while ((linelen = getline(&line, &linecap, fp)) != -1) {
-    while (linelen > 0 && (line[linelen - 1] == '\n' ||
-      line[linelen - 1] == '\r'))
-      linelen--;
+  if (hit == -1) {
+    int64_t y = searchNextRow(config.cy, direction);
+    if (y == -1) return 0;
+    row = editorRowAt(y);
+    at = 0;
+    while (at <= row->size && (at = searchRowFind(d, row, at, &end)) != -1) {
+      hit = at;
+      if (direction > 0) break;
+      at = end > at ? end : at + 1;
+    }
+    config.cy = y;
+  }
+  config.cx = hit;
+  return 1;
+}
 
-    editorInsertRow(config.numrows, line, linelen);
+// first match in the file: 1 found, 0 none, -1 not known yet
+int16_t searchFirst() {
+  struct search *s = &config.search;
+  if (s->qlen == 0 || s->error) return 0;
+  for (int64_t c = 0; c < s->nchunks; c++) {
+    if (!searchChunkDone(c)) return -1;
+    struct searchchunk *ch = &s->chunks[c];
+    if (ch->nrows) {
+      int64_t end;
+      config.cy = ch->rows[0];
+      config.cx = searchRowFind(searchDfa(), editorRowAt(config.cy), 0, &end);
+      return 1;
+    }
   }
+  return 0;
+}
 
-  free(line);
-  fclose(fp);
+// the number of matches found so far, returns how many chunks are done
+int64_t searchTally() {
+  struct search *s = &config.search;
+  int64_t done = 0;
+  s->matches = 0;
+  for (int64_t c = 0; c < s->nchunks; c++) {
+    if (!searchChunkDone(c)) continue;
+    s->matches += s->chunks[c].matches;
+    done++;
+  }
+  return done;
+}
 
-  config.dirty = 0;
+/*
+ * 1-based number of the match that starts at the cursor, 0 when the
+ * cursor is not on one or the rows before it are still being scanned.
+ * cached on the cursor so redraws do not redo it.
+ */
+int64_t searchCursorIndex() {
+  struct search *s = &config.search;
+  if (s->index_cx == config.cx && s->index_cy == config.cy &&
+      s->index_version == s->version && s->index_done == s->ndone)
+    return s->index;
+  s->index_cx = config.cx;
+  s->index_cy = config.cy;
+  s->index_version = s->version;
+  s->index_done = s->ndone;
+  s->index = 0;
+
+  if (s->qlen == 0 || s->error || s->nchunks == 0 ||
+      config.cy >= s->bounds[s->nchunks])
+    return 0;
+  int64_t k = searchChunkOf(config.cy);
+  int64_t n = 0;
+  for (int64_t c = 0; c <= k; c++) {
+    if (!searchChunkDone(c)) return 0;
+    if (c < k) n += s->chunks[c].matches;
+  }
+
+  struct searchchunk *ch = &s->chunks[k];
+  int64_t i = searchChunkIndex(ch, config.cy);
+  if (i == ch->nrows || ch->rows[i] != config.cy) return 0;
+  for (int64_t j = 0; j < i; j++) n += ch->counts[j];
+
+  erow *row = editorRowAt(config.cy);
+  int64_t at = 0, end;
+  while (at <= row->size &&
+         (at = searchRowFind(searchDfa(), row, at, &end)) != -1) {
+    n++;
+    if (at == config.cx) return s->index = n;
+    if (at > config.cx) break;
+    at = end > at ? end : at + 1;
+  }
+  return 0;
+}
 
+// "[n of M]" or "[M matches]" for the status bar, empty without a search
+int16_t searchStatus(char *buf, size_t size) {
+  struct search *s = &config.search;
+  if (s->query == NULL || s->qlen == 0 || s->error || s->stale ||
+      s->recount)
+    return 0;
+
+  const char *more = s->ndone < s->nchunks ? "+" : "";
+  int64_t n = searchCursorIndex();
+  if (n)
+    return snprintf(buf, size, "[%" PRId64 " of %" PRId64 "%s] ",
+                    n, s->matches, more);
+  return snprintf(buf, size, "[%" PRId64 "%s matches] ", s->matches, more);
 }
 
-void editorSave() {
-  if (config.filename == NULL){
-    config.filename = editorPrompt("Save as: %s", 128, NULL);
-    if (config.filename == NULL) {
-      editorSetStatusMessage("Save aborted");
-      return;
+/*
+ * render columns [from, to) of the matches on screen row y, as pairs in
+ * *spans up to *end. only the rows in the viewport are searched, each up
+ * to its last visible column, and only again once the viewport, the
+ * query or the text changes.
+ */
+void searchViewSpans(int16_t y, int64_t **spans, int64_t **end) {
+  struct search *s = &config.search;
+  struct searchview *v = &s->view;
+  *spans = *end = NULL;
+  if (s->query == NULL || s->qlen == 0 || s->error) return;
+
+  int16_t cols = editorTextCols();
+  if (v->rowoff != config.rowoff || v->rows != config.screenrows ||
+      v->coloff != config.coloff || v->cols != cols ||
+      v->version != s->version || v->first == NULL) {
+    v->rowoff = config.rowoff;
+    v->coloff = config.coloff;
+    v->rows = config.screenrows;
+    v->cols = cols;
+    v->version = s->version;
+    v->first = realloc(v->first, (v->rows + 1) * sizeof(int32_t));
+    v->n = 0;
+
+    rowiter it;
+    erow *row = editorRowIterStart(&it, config.rowoff);
+    for (int16_t i = 0; i < v->rows; i++) {
+      v->first[i] = v->n;
+      if (row == NULL) continue;
+
+      // render columns are carried from one match to the next
+      int64_t at = 0, mend, cx = 0, rx = 0;
+      while (at <= row->size &&
+             (at = searchRowFind(searchDfa(), row, at, &mend)) != -1) {
+        rx = editorRowCxToRxFrom(row, at, cx, rx);
+        cx = at;
+        if (rx >= config.coloff + cols) break;
+        if (mend > at) {
+          int64_t rend = editorRowCxToRxFrom(row, mend, cx, rx);
+          if (rend > config.coloff) {
+            if (v->n + 2 > v->cap) {
+              v->cap = v->cap ? v->cap * 2 : 64;
+              v->spans = realloc(v->spans, v->cap * sizeof(int64_t));
+            }
+            v->spans[v->n++] = rx;
+            v->spans[v->n++] = rend;
+          }
+          rx = rend;
+          cx = mend;
+        }
+        at = mend > at ? mend : at + 1;
+      }
+      row = editorRowIterNext(&it);
     }
+    v->first[v->rows] = v->n;
   }
 
-  int16_t len;
-  char *buf = editorRowsToString(&len);
+  if (y < 0 || y >= v->rows) return;
+  *spans = v->spans + v->first[y];
+  *end = v->spans + v->first[y + 1];
+}
 
-  int16_t fd = open(config.filename, O_RDWR | O_CREAT, 0644);
+// "Search [regex,case,word] (n matches): %s", as an editorPrompt format
+void searchSetPrompt(int64_t done) {
+  struct search *s = &config.search;
+  char modes[32] = "";
+  if (s->mode & SEARCH_REGEX) strcat(modes, ",regex");
+  if (s->mode & SEARCH_ICASE) strcat(modes, ",icase");
+  if (s->mode & SEARCH_WORD) strcat(modes, ",word");
+
+  int16_t len = snprintf(s->prompt, sizeof(s->prompt), "Search");
+  if (modes[0])
+    len += snprintf(s->prompt + len, sizeof(s->prompt) - len, " [%s]",
+                    modes + 1);
+  if (s->error)
+    len += snprintf(s->prompt + len, sizeof(s->prompt) - len, " (%s)",
+                    s->error);
+  else if (s->qlen && done < s->nchunks)
+    len += snprintf(s->prompt + len, sizeof(s->prompt) - len,
+                    " (%" PRId64 " matches, %" PRId64 "%%%%)",
+                    s->matches, done * 100 / s->nchunks);
+  else if (s->qlen)
+    len += snprintf(s->prompt + len, sizeof(s->prompt) - len,
+                    " (%" PRId64 " matches)", s->matches);
+  snprintf(s->prompt + len, sizeof(s->prompt) - len, ": %%s");
+}
 
-  if (fd == -1) free(buf);
-  if (ftruncate(fd, len) == -1) close(fd);
-  
-  if (write(fd, buf, len) == len){
-    close(fd);
-    free(buf);
-    editorSetStatusMessage("%d bytes written to disk", len);
-    config.dirty = 0;
-    return;
-  }
+// pick up chunks the workers finished since the last call
+void searchCollect() {
+  struct search *s = &config.search;
+  if (s->query == NULL || s->stale) return;
+
+  s->ndone = searchTally();
+  if (s->ndone == s->nchunks) s->recount = 0;
+  if (!s->prompting) return;
 
-  free(buf);
-  editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+  if (s->jump) {
+    int16_t first = searchFirst();
+    if (first != -1) s->jump = 0;
+    if (first == 1) config.rowoff = config.numrows;   // match on top
+  }
 
+  searchSetPrompt(s->ndone);
+  editorSetStatusMessage(s->prompt, s->query);
 }
 
-/*** search ***/
+/*
+ * rows are about to change under the index: stop the workers before
+ * they read a row that is being edited. the index is rebuilt by
+ * searchResume once the edits pause, so typing does not rescan the
+ * file on every key.
+ */
+void searchInvalidate() {
+  struct search *s = &config.search;
+  s->cut = 0;
+  if (s->query == NULL) return;
+  s->version++;     // matches on screen are found again
+  if (s->stale) return;
+  searchCancel();
+  s->stale = 1;
+  s->staled = s->edited = nowMillis();
+  s->settled = s->version;
+}
 
-void editorSearchCallback(char *query, int16_t key) {
+// ms until a stale index is rebuilt, -1 if it is not stale
+int64_t searchSettleLeft() {
+  struct search *s = &config.search;
+  if (!s->stale) return -1;
+  int64_t now = nowMillis();
+  if (s->settled != s->version) {
+    s->settled = s->version;
+    s->edited = now;
+  }
+  int64_t left = s->edited + SEARCH_SETTLE - now;
+  int64_t most = s->staled + SEARCH_SETTLE_MAX - now;
+  if (most < left) left = most;
+  return left < 0 ? 0 : left;
+}
 
-  static int16_t last_match = -1;
-  static int16_t direction  =  1;
+// rebuild a stale index once edits settle, or right away if now is set
+void searchResume(bool now) {
+  struct search *s = &config.search;
+  if (!s->stale || (!now && searchSettleLeft() > 0)) return;
+  s->stale = 0;
+
+  char *query = s->query;
+  s->query = NULL;    // start over rather than narrow
+  searchStart(query);
+  free(query);
+  s->recount = 1;
+  searchCollect();
+}
 
-  static int16_t saved_hl_line;
-  static char *saved_hl = NULL;
+void searchReset() {
+  struct search *s = &config.search;
+  searchCancel();
+  searchFreeChunks(s->chunks, s->nchunks);
+  searchFreeChunks(s->prev, s->nchunks);
+  free(s->query);
+  dfaFree(&s->dfa);
+  patternFree(s->re);
+  s->chunks = s->prev = NULL;
+  s->query = NULL;
+  s->re = NULL;
+  s->error = NULL;
+  s->qlen = 0;
+  s->nchunks = s->matches = s->ndone = 0;
+  s->jump = s->stale = s->recount = 0;
+  s->version++;
+  searchSetPrompt(0);
+}
 
-  if (saved_hl) {
-    memcpy(config.row[saved_hl_line].hl, saved_hl,
-           config.row[saved_hl_line].rsize);
-    free(saved_hl);
-    saved_hl = NULL;
-  }
+void editorSearchCallback(char *query, int16_t key) {
+  struct search *s = &config.search;
 
   switch (key) {
     case '\r':
+      s->jump = 0;    // keep the results for n and N
+      return;
     case '\x1b':
-      last_match = -1;
-      direction  =  1;
+      searchReset();
       return;
     case ARROW_RIGHT:
     case ARROW_DOWN:
-      direction = 1;
+      s->jump = 0;
+      searchResume(1);
+      if (searchStep(1)) config.rowoff = config.numrows;
       break;
     case ARROW_LEFT:
     case ARROW_UP:
-      direction = -1;
+      s->jump = 0;
+      searchResume(1);
+      if (searchStep(-1)) config.rowoff = config.numrows;
       break;
+    case CTRL_KEY('r'):
+    case CTRL_KEY('t'):
+    case CTRL_KEY('w'):
+      s->mode ^= key == CTRL_KEY('r') ? SEARCH_REGEX :
+                 key == CTRL_KEY('t') ? SEARCH_ICASE : SEARCH_WORD;
+      // fall through
     default:
-      last_match = -1;
-      direction  =  1;
+      searchStart(query);
+      s->jump = 1;    // the first match from the top, once it is known
       break;
-  } 
-  
-  if (last_match == -1) direction = 1;
-  int16_t current = last_match;
-  for (int16_t i = 0; i < config.numrows; i++) {
-    current += direction;
-    
-    if (current == -1) current = config.numrows - 1;
-    else if (current == config.numrows) current = 0;
-
-    erow *row = &config.row[current];
-
-    char *match = strstr(row->render, query);
-    if (match) {
-      last_match = config.cy = current;
-      config.cx = editorRowRxToCx(row, match - row->render);
-      config.rowoff = config.numrows;
-
-      saved_hl_line = current;
-      saved_hl = malloc(row->rsize);
-      memcpy(saved_hl, row->hl, row->rsize);
-
-      memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-      break;
-    }
   }
+
+  searchCollect();
 }
 
 void editorSearch() {
 
-  int16_t saved_cx     = config.cx;
-  int16_t saved_cy     = config.cy;
-  int16_t saved_coloff = config.coloff;
-  int16_t saved_rowoff = config.rowoff;
+  int64_t saved_cx     = config.cx;
+  int64_t saved_cy     = config.cy;
+  int64_t saved_coloff = config.coloff;
+  int64_t saved_rowoff = config.rowoff;
 
-  char *query = editorPrompt("Search: %s", 128, editorSearchCallback);
+  searchReset();
+  config.search.prompting = 1;
+  char *query = editorPrompt(config.search.prompt, 128, editorSearchCallback);
+  config.search.prompting = 0;
 
   if (query) {
     free(query);
@@ -673,34 +4427,396 @@ void editorSearch() {
 
 }
 
-/*** append buffer ***/
+/*** replace ***/
 
-struct abuf {
-  char *buf;
-  int16_t len;
+/*
+ * :s/pattern/replacement/flags on the cursor row, :%s/.../ on every
+ * row. any punctuation can stand in for /, a backslash escapes it.
+ * flags: g every match in a row instead of the first, c confirm each,
+ * r regex, i ignore case, w whole words. in regex mode & in the
+ * replacement stands for the matched text.
+ *
+ * every changed row is rebuilt once with all its replacements and
+ * swapped in whole, rather than edited a character at a time.
+ */
+
+struct replace {
+  char *rep;
+  size_t replen;
+  bool regex;
+  bool global;
+  int64_t count;    // matches replaced
 };
 
-#define ABUF_INIT {NULL, 0};
+void replaceExpand(struct abuf *ab, struct replace *r, const char *match,
+                   int64_t mlen) {
+  if (!r->regex) {
+    abAppend(ab, r->rep, r->replen);
+    return;
+  }
+  for (size_t i = 0; i < r->replen; i++) {
+    char c = r->rep[i];
+    if (c == '&') {
+      abAppend(ab, match, mlen);
+    } else if (c == '\\' && i + 1 < r->replen) {
+      c = r->rep[++i];
+      abAppend(ab, c == 't' ? "\t" : &c, 1);
+    } else {
+      abAppend(ab, &c, 1);
+    }
+  }
+}
 
-void abAppend(struct abuf *ab, const char *s, int16_t len) {
-  char *new = realloc(ab->buf, ab->len + len);
+/*
+ * replace matches in row starting at or after from: the first one, or
+ * all of them with the g flag. returns the column just past the last
+ * replacement, or -1 when nothing matched.
+ */
+int64_t replaceRow(struct replace *r, int64_t y, erow *row, int64_t from) {
+  static struct abuf ab = ABUF_INIT;    // scratch, reused for every row
+  dfa *d = searchDfa();
+  int64_t copied = 0, at = from, end, last = -1, first = -1;
+
+  while (at <= row->size && (at = searchRowFind(d, row, at, &end)) != -1) {
+    abAppend(&ab, &row->chars[copied], at - copied);
+    if (first == -1) first = at;
+    replaceExpand(&ab, r, &row->chars[at], end - at);
+    copied = end;
+    last = ab.len;
+    r->count++;
+    if (!r->global) break;
+    at = end > at ? end : at + 1;
+  }
 
-  if (new == NULL) return;
-  memcpy(&new[ab->len], s, len);
-  ab->buf = new;
-  ab->len += len;
+  if (last != -1) {
+    // one undo record pair for the span from the first match to the last
+    undoRecord(UNDO_DELETE, y, first, &row->chars[first], copied - first);
+    undoRecord(UNDO_INSERT, y, first, &ab.buf[first], last - first);
+    abAppend(&ab, &row->chars[copied], row->size - copied);
+    char *chars = malloc(ab.len + 1);
+    memcpy(chars, ab.buf, ab.len);
+    chars[ab.len] = '\0';
+    editorRowReplace(row, y, chars, ab.len);
+  }
+  abClear(&ab);
+  return last;
 }
 
-void abFree(struct abuf *ab){
-  free(ab->buf);
+// ask about each match in row; returns false once the user quits
+bool replaceConfirm(struct replace *r, int64_t y, erow *row, bool *all) {
+  dfa *d = searchDfa();
+  int64_t at = 0, end;
+
+  while (at <= row->size && (at = searchRowFind(d, row, at, &end)) != -1) {
+    config.cy = y;
+    config.cx = at;
+    editorSetStatusMessage("replace with %.*s (y/n/a/q)?",
+                           (int) r->replen, r->rep);
+    editorRefreshScreen();
+
+    int16_t c = editorReadKey();
+    if (c == 'q' || c == '\x1b') return 0;
+    if (c == 'a') {
+      *all = 1;
+      replaceRow(r, y, row, at);
+      return 1;
+    }
+    if (c == 'y') {
+      // one at a time, the rest of the row is still to be asked about
+      bool global = r->global;
+      r->global = 0;
+      end = replaceRow(r, y, row, at);
+      r->global = global;
+    }
+    if (!r->global) break;
+    at = end > at ? end : at + 1;
+  }
+  return 1;
+}
+
+// take the next delimited field of s, unescaping the delimiter
+char *replaceField(char **s, char delim) {
+  char *out = *s, *w = *s, *p = *s;
+  while (*p && *p != delim) {
+    if (p[0] == '\\' && p[1] == delim) p++;
+    *w++ = *p++;
+  }
+  if (*p) p++;
+  *w = '\0';
+  *s = p;
+  return out;
+}
+
+void editorReplace(char *cmd) {
+  bool whole = *cmd == '%';
+  if (whole) cmd++;
+  if (*cmd != 's' || !ispunct((unsigned char) cmd[1])) {
+    editorSetStatusMessage("unknown command: %s", cmd);
+    return;
+  }
+  char delim = cmd[1];
+  cmd += 2;
+
+  char *pat = replaceField(&cmd, delim);
+  struct replace r = {0};
+  r.rep = replaceField(&cmd, delim);
+  r.replen = strlen(r.rep);
+
+  bool confirm = 0;
+  int16_t mode = 0;
+  for (; *cmd; cmd++) {
+    switch (*cmd) {
+      case 'g': r.global = 1; break;
+      case 'c': confirm = 1; break;
+      case 'r': mode |= SEARCH_REGEX; break;
+      case 'i': mode |= SEARCH_ICASE; break;
+      case 'w': mode |= SEARCH_WORD; break;
+      default:
+        editorSetStatusMessage("unknown flag: %c", *cmd);
+        return;
+    }
+  }
+  r.regex = (mode & SEARCH_REGEX) != 0;
+
+  // the pattern becomes the current search, so matches show while asking
+  searchReset();
+  config.search.mode = mode;
+  searchStart(pat);
+  if (config.search.error || pat[0] == '\0') {
+    editorSetStatusMessage("bad pattern: %s", config.search.error ?
+                           config.search.error : "empty");
+    searchReset();
+    return;
+  }
+
+  if (whole) editorLoadAll();
+  int64_t from = whole ? 0 : config.cy;
+  int64_t to = whole ? config.numrows : config.cy + 1;
+  int64_t cx = config.cx, cy = config.cy, rows = 0;
+  bool all = !confirm, quit = 0;
+
+  rowiter it;
+  erow *row = editorRowIterStart(&it, from);
+  for (int64_t y = from; row && y < to && !quit; y++) {
+    int64_t before = r.count;
+    if (all) replaceRow(&r, y, row, 0);
+    else quit = !replaceConfirm(&r, y, row, &all);
+    if (r.count > before) {
+      rows++;
+      cy = y;
+    }
+    row = editorRowIterNext(&it);
+  }
+
+  // end up on the last changed row
+  config.cy = cy;
+  config.cx = r.count ? 0 : cx;
+  editorSetStatusMessage("%" PRId64 " replaced on %" PRId64 " line%s%s",
+                         r.count, rows, rows == 1 ? "" : "s",
+                         config.undo.overflow ? ", too large to undo" : "");
+}
+
+void editorCommand() {
+  char *cmd = editorPrompt(":%s", 256, NULL);
+  if (cmd == NULL) return;
+  editorReplace(cmd);
+  free(cmd);
+}
+
+/*** screen buffer ***/
+
+/*
+ * frames are drawn into a back buffer of cells and compared against the
+ * front buffer, which mirrors what the terminal currently shows. only
+ * the cells that differ are sent, so moving the cursor or typing a
+ * character costs a handful of bytes instead of a whole screen.
+ */
+
+#define SCR_MERGE_GAP 6   // rewriting this many equal cells beats a cursor jump
+
+bool scrAttrEqual(scell *a, scell *b) {
+  return a->fg == b->fg && a->bg == b->bg && a->style == b->style;
+}
+
+bool scrCellEqual(scell *a, scell *b) {
+  return a->c == b->c && scrAttrEqual(a, b);
+}
+
+void scrBegin() {
+  struct screen *scr = &config.screen;
+  int16_t rows = config.screenrows + 2;
+  int16_t cols = config.screencols;
+
+  if (scr->rows != rows || scr->cols != cols) {
+    free(scr->front);
+    free(scr->back);
+    scr->front = malloc(sizeof(scell) * rows * cols);
+    scr->back = malloc(sizeof(scell) * rows * cols);
+    if (scr->front == NULL || scr->back == NULL) die("malloc");
+    scr->rows = rows;
+    scr->cols = cols;
+    scr->valid = 0;
+  }
+
+  scell blank = {' ', 0, 0, 0};
+  for (int32_t i = 0; i < rows * cols; i++) scr->back[i] = blank;
+}
+
+void scrPut(int16_t y, int16_t x, char c, uint8_t fg, uint8_t bg,
+            uint8_t style) {
+  struct screen *scr = &config.screen;
+  if (y < 0 || y >= scr->rows || x < 0 || x >= scr->cols) return;
+  if (iscntrl((unsigned char) c)) c = '?';
+  scell cell = {c, fg, bg, style};
+  scr->back[y * scr->cols + x] = cell;
+}
+
+int16_t scrPuts(int16_t y, int16_t x, const char *s, int16_t len, uint8_t fg,
+                uint8_t bg, uint8_t style) {
+  for (int16_t i = 0; i < len; i++) scrPut(y, x++, s[i], fg, bg, style);
+  return x;
+}
+
+void scrFill(int16_t y, int16_t x, char c, uint8_t fg, uint8_t bg,
+             uint8_t style) {
+  while (x < config.screen.cols) scrPut(y, x++, c, fg, bg, style);
+}
+
+void scrAppendAttr(struct abuf *ab, scell *cell) {
+  char buf[32];
+  int16_t len = snprintf(buf, sizeof(buf), "\x1b[0%s%s%s",
+      cell->style & STYLE_BOLD   ? ";1" : "",
+      cell->style & STYLE_ITALIC ? ";3" : "",
+      cell->style & STYLE_INVERT ? ";7" : "");
+  if (cell->fg) len += snprintf(&buf[len], sizeof(buf) - len, ";%d", cell->fg);
+  if (cell->bg) len += snprintf(&buf[len], sizeof(buf) - len, ";%d", cell->bg);
+  buf[len++] = 'm';
+  abAppend(ab, buf, len);
+}
+
+void scrAppendMove(struct abuf *ab, int16_t y, int16_t x) {
+  char buf[32];
+  int16_t len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+  abAppend(ab, buf, len);
+}
+
+/*
+ * send the difference between back and front to the terminal and leave
+ * the cursor at y, x. rows holding multi-byte characters are rewritten
+ * from their first column, since a cell index is not a terminal column
+ * there.
+ */
+void scrFlush(int16_t cursor_y, int16_t cursor_x) {
+  struct screen *scr = &config.screen;
+  static struct abuf ab = ABUF_INIT;   // reused from frame to frame
+  scell blank = {' ', 0, 0, 0};
+
+  abClear(&ab);
+
+  if (!scr->valid) {
+    abAppend(&ab, RESET_ESCAPE, 3);
+    abAppend(&ab, CLEAR_SCREEN_STRING, 4);
+    for (int32_t i = 0; i < scr->rows * scr->cols; i++) scr->front[i] = blank;
+    scr->valid = 1;
+  }
+
+  bool hidden = 0;
+  scell attr = blank;
+
+  for (int16_t y = 0; y < scr->rows; y++) {
+    scell *front = &scr->front[y * scr->cols];
+    scell *back = &scr->back[y * scr->cols];
+
+    int16_t x = 0;
+    while (x < scr->cols && scrCellEqual(&front[x], &back[x])) x++;
+    if (x == scr->cols) continue;
+
+    // blank tail that a single clear-line can take care of
+    int16_t tail = scr->cols;
+    while (tail > 0 && back[tail - 1].c == ' '
+           && !(back[tail - 1].style & STYLE_INVERT)
+           && back[tail - 1].bg == back[scr->cols - 1].bg)
+      tail--;
+
+    bool wide = 0;
+    for (int16_t i = 0; i < scr->cols && !wide; i++)
+      wide = (front[i].c & 0x80) || (back[i].c & 0x80);
+    if (wide) x = 0;
+
+    if (!hidden) {
+      abAppend(&ab, "\x1b[?25l", 6);
+      hidden = 1;
+    }
+
+    while (x < scr->cols) {
+      int16_t start = x;
+      int16_t last = x;
+      int16_t end = x + 1;
+      for (; end < scr->cols && (wide || end - last <= SCR_MERGE_GAP); end++)
+        if (!scrCellEqual(&front[end], &back[end])) last = end;
+      end = wide ? scr->cols : last + 1;
+
+      scrAppendMove(&ab, y, x);
+      int16_t stop = end > tail ? tail : end;
+      while (x < stop) {
+        if (!scrAttrEqual(&attr, &back[x])) {
+          attr = back[x];
+          scrAppendAttr(&ab, &attr);
+        }
+        // copy the whole run sharing this attribute in one go
+        int16_t run = x + 1;
+        while (run < stop && scrAttrEqual(&attr, &back[run])) run++;
+        char *p = abExtend(&ab, run - x);
+        if (p == NULL) die("realloc");
+        for (; x < run; x++) *p++ = back[x].c;
+      }
+      if (end > tail) {
+        if (attr.bg != back[tail].bg || attr.style != back[tail].style) {
+          attr = back[tail];
+          scrAppendAttr(&ab, &attr);
+        }
+        abAppend(&ab, CLEAR_LINE_STRING, 3);
+        end = scr->cols;
+      }
+      memcpy(&front[start], &back[start], sizeof(scell) * (end - start));
+      x = end;
+      while (x < scr->cols && scrCellEqual(&front[x], &back[x])) x++;
+    }
+  }
+
+  if (attr.fg || attr.bg || attr.style) abAppend(&ab, RESET_ESCAPE, 3);
+
+  if (hidden || cursor_y != scr->cursor_y || cursor_x != scr->cursor_x) {
+    scrAppendMove(&ab, cursor_y, cursor_x);
+    scr->cursor_y = cursor_y;
+    scr->cursor_x = cursor_x;
+  }
+  if (hidden) abAppend(&ab, "\x1b[?25h", 6);
+
+  if (ab.len) write(STDOUT_FILENO, ab.buf, ab.len);
+  scr->frame_bytes = ab.len;
 }
 
 /*** output ***/
 
+int16_t editorLinenoWidth() {
+  int16_t width = 1;
+  for (int64_t n = config.numrows; n >= 10; n /= 10) width++;
+  return MAX(width, LINENO_MIN_WIDTH);
+}
+
+// columns left for text once the line numbers and separator are drawn
+int16_t editorTextCols() {
+  int16_t cols = config.screencols - editorLinenoWidth() - 1;
+  return MAX(cols, 1);
+}
+
 void editorScroll() {
+  // a screen of rows below the cursor to move onto
+  editorLoadBelow(config.cy + config.screenrows);
   config.rx = 0;
   if (config.cy < config.numrows) {
-    config.rx = editorRowCxToRx(&config.row[config.cy], config.cx);
+    config.rx = editorRowCxToRx(editorRowAt(config.cy), config.cx);
   }
   if (config.cy < config.rowoff + SCROLL_PADDING) {
     config.rowoff = config.cy - SCROLL_PADDING;
@@ -711,144 +4827,158 @@ void editorScroll() {
     config.rowoff = config.cy - config.screenrows + 1 + SCROLL_PADDING;
     config.rowoff = MIN(config.rowoff, config.numrows - config.screenrows);
   }
-  if (config.rx < config.coloff + 1) {
-    config.coloff = config.rx - 1;
+  if (config.rx < config.coloff) {
+    config.coloff = config.rx;
   }
-  if (config.rx >= config.coloff + config.screencols){
-    config.coloff = config.rx - config.screencols + 1;
+  if (config.rx >= config.coloff + editorTextCols()){
+    config.coloff = config.rx - editorTextCols() + 1;
   }
 }
 
-void editorDrawRows(struct abuf *ab) {
+void editorDrawRows() {
   int16_t y;
-  char* filenumbuf = malloc(16);
-  int16_t filerow;
+  char filenumbuf[24];
+  int16_t numwidth = editorLinenoWidth();
+  int16_t textcols = editorTextCols();
+  int64_t filerow;
+  editorSyntaxSync(config.rowoff + config.screenrows);
   for (y = 0; y < config.screenrows; y++) {
     filerow = y + config.rowoff;
+    if (filerow >= config.numrows) continue;
+
+    bool current = filerow == config.cy;
+    uint8_t bg = current ? 40 : 0;
+
+    int16_t numlen = snprintf(filenumbuf, sizeof(filenumbuf), "%" PRId64, filerow + 1);
+    memmove(&filenumbuf[numwidth - numlen], filenumbuf, numlen);
+    memset(filenumbuf, ' ', numwidth - numlen);
+    filenumbuf[numwidth] = config.linestart;
+
+    int16_t x = scrPuts(y, 0, filenumbuf, numwidth + 1, current ? 33 : 0, 40, 0);
+
+    erow *row = editorRowAt(filerow);
+    editorRowPrepare(row);
+    int64_t len = row->rsize - config.coloff;
+    len = MAX(len, 0);
+    if (len > textcols) len = textcols;
+
+    int64_t *span, *spanend;
+    searchViewSpans(y, &span, &spanend);
+
+    char *c = &row->render[config.coloff];
+    char *hl = &row->hl[config.coloff];
+    for (int64_t i = 0; i < len; i++) {
+      uint8_t fg = hl[i] == HL_NORMAL ? 0 : editorSyntaxToColor(hl[i]);
+      while (span < spanend && config.coloff + i >= span[1]) span += 2;
+      if (span < spanend && config.coloff + i >= span[0])
+        fg = editorSyntaxToColor(HL_MATCH);
+      scrPut(y, x++, c[i], fg, bg, hl[i] == HL_ESCAPE ? STYLE_ITALIC : 0);
+    }
 
-    sprintf(filenumbuf, "%5d", filerow + 1);
+    scrFill(y, x, ' ', 0, bg, 0);
+  }
+}
 
-    abAppend(ab, "\x1b[40m", 5);
-    if (filerow == config.cy){
-      abAppend(ab, "\x1b[33m", 5);
-      abAppend(ab, filenumbuf, 5);
-      abAppend(ab, &config.linestart, 1);
-      abAppend(ab, "\x1b[39m", 5); 
-    } else {
-      if (filerow < config.numrows) {
-        abAppend(ab, filenumbuf, 5);
-        abAppend(ab, &config.linestart, 1);
-      }
-      abAppend(ab, "\x1b[49m", 5);
-    }
-    
-    if (filerow < config.numrows) {
-      int16_t len = config.row[filerow].rsize - config.coloff;
-      len = MAX(len, 0);
-      if (len > config.screencols) len = config.screencols;
-      
-      char *c = &config.row[filerow].render[config.coloff];
-      char *hl = &config.row[filerow].hl[config.coloff];
-      int16_t current_color = -1;
-      if (len > 1){
-        for (int16_t i = 0; i < len; i++){
-          if (hl[i] == HL_NORMAL) {
-            if (current_color != -1){
-              abAppend(ab, "\x1b[39m", 5);
-              current_color = -1;
-            }
-            abAppend(ab, &c[i], 1);
-          } else {
-            int16_t color = editorSyntaxToColor(hl[i]);
-            if (hl[i] == HL_ESCAPE) {
-                abAppend(ab, ITALIC_ESCAPE, 4);
-            } else if (hl[i - 1] == HL_ESCAPE) {
-                abAppend(ab, RESET_ESCAPE, 3);
-                current_color = 0; // reset so string maintains color
-            }
-            if (color != current_color) {
-              current_color = color; 
-              char buf[16];
-              int16_t clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color); 
-              abAppend(ab, buf, clen);
-            } 
-            abAppend(ab, &c[i], 1);
-          }
-        }
-        abAppend(ab, "\x1b[39m", 5);
-      }
-    }
-    
-    abAppend(ab, CLEAR_LINE_STRING, 3);
-    abAppend(ab, "\r\n", 2);
+/*
+ * drop render and hl of rows outside [lo, hi) once more than
+ * HL_CACHE_ROWS rows hold them, so memory follows the viewport rather
+ * than everything ever scrolled past. the rows keep their syntax states
+ * and are rendered again if they come back into view.
+ */
+void editorTrimRendered(int64_t lo, int64_t hi) {
+  if (config.rendered <= HL_CACHE_ROWS) return;
+  rowiter it;
+  int64_t y = 0;
+  for (erow *row = editorRowIterStart(&it, 0); row;
+       row = editorRowIterNext(&it), y++) {
+    if (row->render == NULL || (y >= lo && y < hi)) continue;
+    free(row->render);
+    free(row->hl);
+    row->render = NULL;
+    row->hl = NULL;
+    config.rendered--;
   }
-  free(filenumbuf);
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
-  abAppend(ab, INVERT_ESCAPE, 4);
+/*
+ * render the rows just beyond the viewport once the frame is out, so a
+ * little scrolling finds them ready, and keep the cache within budget.
+ */
+void editorPrefetchRows() {
+  int64_t lo = config.rowoff - HL_LOOKAHEAD;
+  int64_t hi = config.rowoff + config.screenrows + HL_LOOKAHEAD;
+  lo = MAX(lo, 0);
+  editorSyntaxSync(hi);
+
+  rowiter it;
+  int64_t y = lo;
+  for (erow *row = editorRowIterStart(&it, lo); row && y < hi;
+       row = editorRowIterNext(&it), y++)
+    editorRowPrepare(row);
+  editorTrimRendered(lo, hi);
+}
+
+void editorDrawStatusBar() {
+  int16_t y = config.screenrows;
   char status[80], rstatus[80];
   
-  int16_t len = snprintf(status, sizeof(status), " %.20s%s - %d lines | %s", 
+  int16_t len = snprintf(status, sizeof(status), " %.20s%s - %" PRId64 " lines | %s | %s", 
       config.filename ? config.filename : "<unnamed>", 
       config.dirty ? "*" : "", config.numrows,
-      getModeName(config.mode));
-  int16_t rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d ",
-      config.cx, config.cy + 1);
+      config.syntax->name,
+      config.follow.on ? "FOLLOW" : getModeName(config.mode));
+  int16_t rlen = searchStatus(rstatus, sizeof(rstatus));
+  rlen += snprintf(rstatus + rlen, sizeof(rstatus) - rlen,
+      "%zuB %" PRId64 "/%" PRId64 " ",
+      config.screen.frame_bytes, config.cx, config.cy + 1);
 
   len = MIN(len, config.screencols);
 
-  abAppend(ab, status, len);
-
-  // fill remaining space
-  while (len < config.screencols){
-    if (config.screencols - len == rlen) {
-      abAppend(ab, rstatus, rlen);
-      break;
-    } else {
-      abAppend(ab, " ", 1);
-      len++;
-    }
-  }
-  abAppend(ab, RESET_ESCAPE, 3);
-  abAppend(ab, "\r\n", 2);
+  scrPuts(y, 0, status, len, 0, 0, STYLE_INVERT);
+  scrFill(y, len, ' ', 0, 0, STYLE_INVERT);
+  if (config.screencols - len >= rlen)
+    scrPuts(y, config.screencols - rlen, rstatus, rlen, 0, 0, STYLE_INVERT);
 }
 
-void editorDrawMessageBar(struct abuf *ab){
-
-  abAppend(ab, BOLD_ESCAPE, 4);
-
-  abAppend(ab, CLEAR_LINE_STRING, 3);
+void editorDrawMessageBar(){
+  int16_t y = config.screenrows + 1;
   int16_t msglen = strlen(config.statusmsg);
   msglen = MIN(msglen, config.screencols);
-  if (msglen && time(NULL) - config.statusmsg_time < 5)
-    abAppend(ab, config.statusmsg, msglen);
+  if (msglen && nowMillis() - config.statusmsg_time < STATUS_TIMEOUT * 1000)
+    scrPuts(y, 0, config.statusmsg, msglen, 0, 0, STYLE_BOLD);
+}
 
-  abAppend(ab, RESET_ESCAPE, 3);
+/*
+ * pick up a new terminal size. the terminal's contents are undefined
+ * after a resize so the next frame is sent in full, but only rows that
+ * end up in the new viewport get rendered.
+ */
+void editorHandleResize() {
+  config.resized = 0;
+
+  int16_t rows, cols;
+  if (getWindowSize(&rows, &cols) == -1) return;
+
+  config.screenrows = MAX(rows - 2, 1);
+  config.screencols = MAX(cols, 1);
+
+  int64_t maxoff = config.numrows - config.screenrows;
+  maxoff = MAX(maxoff, 0);
+  config.rowoff = MIN(config.rowoff, maxoff);
+  config.screen.valid = 0;
 }
 
 void editorRefreshScreen() {
+  if (config.resized) editorHandleResize();
   editorScroll();
 
-  struct abuf ab = ABUF_INIT;
-
-  abAppend(&ab, "\x1b[?25l", 6);
-  abAppend(&ab, RESET_MOUSE_POS_STRING, 3);
-
-  editorDrawRows(&ab);
-  editorDrawStatusBar(&ab);
-  editorDrawMessageBar(&ab);
-
-  char buf[32];
-  snprintf(buf,sizeof(buf),"\x1b[%d;%dH",
-  (config.cy - config.rowoff)+1, (config.rx - config.coloff)+CURSOR_OFFSET);
-
-  abAppend(&ab, buf, strlen(buf));
-
-  abAppend(&ab, "\x1b[?25h", 6);
+  scrBegin();
+  editorDrawRows();
+  editorDrawStatusBar();
+  editorDrawMessageBar();
 
-  write(STDOUT_FILENO, ab.buf, ab.len);
-  abFree(&ab);
+  scrFlush(config.cy - config.rowoff,
+           config.rx - config.coloff + editorLinenoWidth() + 1);
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -856,7 +4986,7 @@ void editorSetStatusMessage(const char *fmt, ...) {
   va_start(ap, fmt);
   vsnprintf(config.statusmsg, sizeof(config.statusmsg), fmt, ap);
   va_end(ap);
-  config.statusmsg_time = time(NULL);
+  config.statusmsg_time = nowMillis();
 }
 
 /*** input ***/
@@ -870,10 +5000,23 @@ char *editorPrompt(char *prompt, size_t maxlen, void (*callback)(char*, int16_t)
 
   while(1){
     editorSetStatusMessage(prompt, buf);
-    editorRefreshScreen();
+    if (!editorKeysPending()) editorRefreshScreen();
 
     int16_t c = editorReadKey();
-    if (c == KEY_DEL || c == CTRL_KEY('h') || c == BACKSPACE) {
+    if (c == KEY_PASTE) {
+      size_t len;
+      char *paste = editorReadPaste(&len);
+      for (size_t i = 0; i < len && buflen < maxlen; i++) {
+        if (iscntrl((unsigned char) paste[i])) continue;
+        if (buflen == bufsize - 1) {
+          bufsize *= 2;
+          buf = realloc(buf, bufsize);
+        }
+        buf[buflen++] = paste[i];
+      }
+      buf[buflen] = '\0';
+      free(paste);
+    } else if (c == KEY_DEL || c == CTRL_KEY('h') || c == BACKSPACE) {
       if (buflen != 0) buf[--buflen] = '\0';
     } else if (c == '\x1b') {
       editorSetStatusMessage("");
@@ -901,14 +5044,14 @@ char *editorPrompt(char *prompt, size_t maxlen, void (*callback)(char*, int16_t)
 }
 
 void editorMoveCursor(int16_t key) {
-  erow *row = (config.cy >= config.numrows) ? NULL : &config.row[config.cy]; 
+  erow *row = (config.cy >= config.numrows) ? NULL : editorRowAt(config.cy); 
 
   switch (key) {
     case ARROW_LEFT:
       config.cx--;
       if (config.cx < 0 && config.cy > 0) {
         // go to previous line
-        config.cx = config.row[--config.cy].size;
+        config.cx = editorRowAt(--config.cy)->size;
       }
       config.cx = MAX(config.cx, 0);
       break;
@@ -931,7 +5074,7 @@ void editorMoveCursor(int16_t key) {
       break;
   }
   
-  row = (config.cy >= config.numrows) ? NULL : &config.row[config.cy];
+  row = (config.cy >= config.numrows) ? NULL : editorRowAt(config.cy);
   config.cx = MIN(config.cx, row->size);
 }
 
@@ -949,6 +5092,7 @@ void editorProcessInsertMode(int16_t c) {
     case KEY_END:
     case KEY_PAGE_UP:
     case KEY_PAGE_DOWN:
+    case KEY_PASTE:
     case CTRL_KEY('q'):
     case CTRL_KEY('s'):
       break;
@@ -987,7 +5131,7 @@ void editorProcessInsertMode(int16_t c) {
         editorInsertChar(getCloseBrace(c));
         config.cx--;
       } 
-      if (c == getCloseBrace(config.row[config.cy].chars[config.cx - 2])
+      if (c == getCloseBrace(editorRowAt(config.cy)->chars[config.cx - 2])
           && c != ' '){
         editorDelChar();
         config.cx++;
@@ -1012,21 +5156,21 @@ void editorProcessNormalMode(int16_t c) {
     case 'a':
       if (c == 'a') {
         config.cx++;
-        config.cx = MIN(config.cx, config.row[config.cy].size);
+        config.cx = MIN(config.cx, editorRowAt(config.cy)->size);
       }
       config.mode = MODE_INSERT;
       break;
 
     case ';':
-      config.cx = config.row[config.cy].size;
+      config.cx = editorRowAt(config.cy)->size;
       config.mode = MODE_INSERT;
-      if (config.row[config.cy].chars[config.cx - 1] != ';'){
+      if (config.cx == 0 || editorRowAt(config.cy)->chars[config.cx - 1] != ';'){
         editorInsertChar(';');
       }
       break;
 
 		case 'o':
-			config.cx = config.row[config.cy].size;
+			config.cx = editorRowAt(config.cy)->size;
 			editorInsertNewLine();
       config.mode = MODE_INSERT;
 			break;
@@ -1039,7 +5183,7 @@ void editorProcessNormalMode(int16_t c) {
 			break;
 
 		case 'A':
-      config.cx = MAX(config.row[config.cy].size, 0);
+      config.cx = MAX(editorRowAt(config.cy)->size, 0);
       config.mode = MODE_INSERT;
       break;
 
@@ -1061,12 +5205,27 @@ void editorProcessNormalMode(int16_t c) {
       editorSearch();
       break;
 
+    case ':':
+      editorCommand();
+      break;
+
+    case 'n':
+    case 'N':
+      searchResume(1);
+      searchStep(c == 'n' ? 1 : -1);
+      break;
+
+    case 'u':
+      editorUndo();
+      break;
+
     case 'g':
       promptbuffer = editorPrompt("go to line: %s", 16, NULL);
-      config.cy = promptbuffer ? atoi(promptbuffer) - 1 : config.cy;
+      config.cy = promptbuffer ? strtoll(promptbuffer, NULL, 10) - 1 : config.cy;
+      editorLoadBelow(config.cy - 1);
       config.cy = MIN(config.cy, config.numrows - 1);
       config.cy = MAX(config.cy, 0);
-      config.cx = MIN(config.cx, config.row[config.cy].size);
+      config.cx = MIN(config.cx, editorRowAt(config.cy)->size);
       break;
 
     case '0':
@@ -1074,10 +5233,11 @@ void editorProcessNormalMode(int16_t c) {
       break;
 
     case '$':
-      config.cx = config.row[config.cy].size;
+      config.cx = editorRowAt(config.cy)->size;
       break;
 
     case 'G':
+      editorLoadAll();
       config.cy = config.numrows - 1;
       config.cx = 0;
       break;
@@ -1099,12 +5259,21 @@ void editorProcessCommon(int16_t c) {
       }
       write(STDOUT_FILENO, CLEAR_SCREEN_STRING, 4);
       write(STDOUT_FILENO, RESET_MOUSE_POS_STRING, 3);
+      swapRemove();
       exit(0);
 
     case CTRL_KEY('s'):
       editorSave();
       break;
 
+    case KEY_PASTE:
+      editorPaste();
+      break;
+
+    case CTRL_KEY('r'):
+      editorRedo();
+      break;
+
     case ARROW_LEFT:
     case ARROW_RIGHT:
     case ARROW_UP:
@@ -1123,17 +5292,18 @@ void editorProcessCommon(int16_t c) {
       config.cx = 0;
       break;
     case KEY_END:
-      config.cx = MAX(config.row[config.cy].rsize, 0);
+      config.cx = editorRowAt(config.cy)->size;
       break;
     
     case CTRL_KEY('d'):
-      editorDelRow(config.cy);
+      editorDelLine();
       config.cy--;
       config.cy = MAX(config.cy, 0);
-      config.cx = config.row[config.cy].size;
+      config.cx = editorRowAt(config.cy)->size;
       break;
 
     case '\x1b':
+      if (config.mode == MODE_NORMAL) searchReset();   // drop highlights
       config.mode = MODE_NORMAL;
       break;
 
@@ -1145,6 +5315,11 @@ void editorProcessCommon(int16_t c) {
 
 void editorProcessKeypress() {
   int16_t c = editorReadKey();
+  if (config.follow.on && followBlocks(c)) {
+    editorSetStatusMessage("Read-only while following the file");
+    return;
+  }
+  undoKey(c);
   
   editorProcessCommon(c);
 
@@ -1156,6 +5331,100 @@ void editorProcessKeypress() {
       editorProcessInsertMode(c); 
       break;
   }
+  config.undo.cx = config.cx;
+  config.undo.cy = config.cy;
+}
+
+/*** event loop ***/
+
+/*
+ * the editor sleeps in poll() until the terminal has input, something
+ * writes to the wake pipe (signal handlers, see editorWake) or the next
+ * timer is due, so an idle editor uses no cpu at all.
+ */
+
+void editorWake() {
+  int saved_errno = errno;   // may run inside a signal handler
+  write(config.wakefd[1], "", 1);
+  errno = saved_errno;
+}
+
+void handleSigwinch(int sig) {
+  (void) sig;
+  config.resized = 1;
+  editorWake();
+}
+
+// for timeouts only, so a clock that never jumps when the date is set
+int64_t nowMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// milliseconds until the next timed event, -1 when there is none
+int editorNextTimeout() {
+  int64_t timeout = -1;
+
+  if (config.statusmsg[0]) {
+    int64_t left = config.statusmsg_time + STATUS_TIMEOUT * 1000 - nowMillis();
+    if (left > 0) timeout = left;
+  }
+
+  if (config.swap.due) {
+    int64_t left = config.swap.due - nowMillis();
+    if (left < 0) left = 0;
+    if (timeout == -1 || left < timeout) timeout = left;
+  }
+
+  int64_t settle = searchSettleLeft();
+  if (settle != -1 && (timeout == -1 || settle < timeout)) timeout = settle;
+
+  if (config.follow.more || config.loaded < config.maplen) timeout = 0;
+
+  return timeout;
+}
+
+// block until stdin is readable, redrawing whenever something else woke us
+void editorWaitInput() {
+  struct pollfd fds[3] = {
+    {STDIN_FILENO, POLLIN, 0},
+    {config.wakefd[0], POLLIN, 0},
+    {config.follow.ifd, POLLIN, 0},   // -1, so ignored, unless following
+  };
+
+  while (1) {
+    int n = poll(fds, 3, editorNextTimeout());
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      die("poll");
+    }
+    swapTick();
+    if (fds[2].revents & POLLIN) followDrain();
+    if (fds[2].revents & POLLIN || config.follow.more) followRead();
+    if (fds[0].revents) return;
+    editorLoadRows(config.loaded + LOAD_STEP);
+
+    if (fds[1].revents & POLLIN) {
+      char buf[64];
+      while (read(config.wakefd[0], buf, sizeof(buf)) > 0);
+    }
+
+    searchResume(0);
+    searchCollect();
+    editorRefreshScreen();
+  }
+}
+
+void initEventLoop() {
+  if (pipe2(config.wakefd, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe2");
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleSigwinch;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
 }
 
 /*** init ***/
@@ -1167,18 +5436,43 @@ void initEditor() {
   config.rowoff = 0;
   config.coloff = 0;
   config.numrows = 0;
-  config.row = NULL;
+  config.rows = rowNewNode(1);
+  config.hlvalid = 0;
+  config.rendered = 0;
+  config.syntax = &syntaxdb[0];
+  syntaxBuildTable(config.syntax);
+  config.map = NULL;
+  config.maplen = config.loaded = 0;
+  config.mapdisk = 0;
+  config.disk.st_ino = 0;
   config.filename = NULL;
   config.statusmsg[0] = '\0';
   config.statusmsg_time = 0;
   config.dirty = 0;
   config.linestart = '|';
   config.mode = MODE_NORMAL;
-
+  config.screen.front = NULL;
+  config.screen.back = NULL;
+  config.screen.rows = 0;
+  config.screen.cols = 0;
+  config.screen.cursor_y = -1;
+  config.screen.cursor_x = -1;
+  config.screen.valid = 0;
+  config.screen.frame_bytes = 0;
+  config.input.len = 0;
+  config.input.pos = 0;
+  config.undo.limit = UNDO_LIMIT;
+  config.swap.path = NULL;
+  config.swap.last = -1;
+  config.follow.on = 0;
+  config.follow.fd = -1;
+  config.follow.ifd = -1;
+
+  config.resized = 0;
   if (getWindowSize(&config.screenrows, &config.screencols) == -1)
     die("getWindowSize");
 
-  config.screenrows -= 2;
+  config.screenrows = MAX(config.screenrows - 2, 1);
 
 }
 
@@ -1186,18 +5480,29 @@ int main(int argc, char *argv[]){
 
   enableRawMode();
   initEditor();
+  initEventLoop();
+  // before the file is opened, which may have more to say
+  editorSetStatusMessage("PICO v" PICO_VERSION);
 
-  if (argc >= 2) {
+  if (argc >= 3 && strcmp(argv[1], "-f") == 0) {
+    config.follow.on = 1;
+    editorOpen(argv[2]);
+    followStart();
+  } else if (argc >= 2) {
     editorOpen(argv[1]);
   } else {
     editorInsertRow(0, "", 0);
   }
 
-  editorSetStatusMessage("PICO v" PICO_VERSION);
-
   while (1) {
+    // catch a truncated file before drawing rows that may be gone
+    if (config.follow.on) followRead();
+    searchResume(0);
     editorRefreshScreen();
-    editorProcessKeypress();
+    editorPrefetchRows();
+    do {
+      editorProcessKeypress();
+    } while (editorKeysPending());
   }
 
   return 0;
@@ -0,0 +1,96 @@
+// swap log records, built with the editor itself: make test
+#define main pico_main
+#include "../pico.c"
+#undef main
+
+int failed = 0;
+
+#define CHECK(cond) do { \
+  if (!(cond)) { \
+    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+    failed++; \
+  } \
+} while (0)
+
+void swapSetup() {
+  struct swap *w = &config.swap;
+  free(w->buf);
+  memset(w, 0, sizeof(*w));
+  w->path = "test.swp";     // only checked for NULL, nothing is written
+  w->last = -1;
+  pthread_mutex_init(&w->lock, NULL);
+}
+
+// the record at *p: its type, where it applies and for inserts the text
+void swapNext(char **p, int8_t *type, uint64_t *y, uint64_t *x,
+              uint64_t *len, char **text) {
+  struct swap *w = &config.swap;
+  char *end = w->buf + w->len;
+  uint64_t ey;
+  *type = *(*p)++;
+  CHECK(swapVarint(p, end, y));
+  CHECK(swapVarint(p, end, x));
+  CHECK(swapVarint(p, end, *type == UNDO_INSERT ? len : &ey));
+  if (*type == UNDO_INSERT) {
+    *text = *p;
+    *p += *len;
+  } else {
+    CHECK(swapVarint(p, end, len));
+  }
+  CHECK(*p <= end);
+}
+
+/*
+ * typing on from an insert grows its length, which takes one byte more
+ * once it reaches 128 and again at 16384. the merged record has to fit
+ * even when the text alone fills the buffer up to its capacity.
+ */
+void testMergeAcrossVarint(size_t before, size_t grow) {
+  swapSetup();
+  char *text = malloc(before + grow);
+  memset(text, 'a', before);
+  memset(text + before, 'b', grow);
+
+  // pad the buffer so the first insert ends one byte short of the cap
+  char head[16];
+  size_t cap = before < 4000 ? 4096 : 32768;
+  size_t used = 5 + 3 + (putVarint(head, before) - head) + before;
+  size_t pad = 0;
+  for (int16_t vl = 1; vl <= 3; vl++) {
+    pad = cap - 1 - used - 3 - vl;
+    if (putVarint(head, pad) - head == vl) break;
+  }
+  char *fill = malloc(pad);
+  memset(fill, 'f', pad);
+  swapRecord(UNDO_INSERT, 1, 0, fill, pad);
+  swapRecord(UNDO_DELETE, 2, 0, "x", 1);
+  swapRecord(UNDO_INSERT, 0, 0, text, before);
+  swapRecord(UNDO_INSERT, 0, before, text + before, grow);
+
+  struct swap *w = &config.swap;
+  CHECK(w->len <= w->cap);
+  char *p = w->buf, *t;
+  int8_t type;
+  uint64_t y, x, len;
+  swapNext(&p, &type, &y, &x, &len, &t);
+  CHECK(type == UNDO_INSERT && y == 1 && x == 0 && len == pad);
+  swapNext(&p, &type, &y, &x, &len, &t);
+  CHECK(type == UNDO_DELETE && y == 2 && x == 0 && len == 1);
+  swapNext(&p, &type, &y, &x, &len, &t);
+  CHECK(type == UNDO_INSERT && y == 0 && x == 0 && len == before + grow);
+  CHECK(len == before + grow && memcmp(t, text, len) == 0);
+  CHECK(p == w->buf + w->len);
+
+  free(fill);
+  free(text);
+}
+
+int main() {
+  testMergeAcrossVarint(127, 1);
+  testMergeAcrossVarint(126, 2);
+  testMergeAcrossVarint(16383, 1);
+  testMergeAcrossVarint(100, 100);
+  if (failed) return 1;
+  printf("swap: ok\n");
+  return 0;
+}